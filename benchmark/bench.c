@@ -0,0 +1,502 @@
+#include "../my_vm.h"
+#include <time.h>
+
+//Microbenchmarks for the VM. Every case runs warmup untimed repetitions and
+//then reps timed ones, and reports percentiles over the timed repetitions as
+//one JSON object per case. Inputs come from a fixed seed, so two runs of the
+//same build do the same work.
+//
+//  ./bench [-r reps] [-w warmup] [-q] > results.json
+//
+//-q shrinks the work per repetition for quick CI runs.
+
+#define PHYSICAL_MEM_SIZE (256UL * 1024 * 1024)
+#define MAX_REPS 1000
+
+int reps = 10;
+int warmup = 2;
+unsigned long ops = 1 << 16;
+bool first_result = true;
+unsigned long rng_state = 0x9e3779b97f4a7c15UL;
+
+static unsigned long next_random() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+//Nearest rank percentile of sorted samples
+static double percentile(double *sorted, int count, double p) {
+    int rank = (int) (p / 100 * count + 0.5);
+    if(rank < 1) {
+        rank = 1;
+    }
+    if(rank > count) {
+        rank = count;
+    }
+    return sorted[rank - 1];
+}
+
+/*
+Prints one result. params is a JSON object body such as "\"size\": 16", and
+extra, when not NULL, adds more fields after the percentiles.
+*/
+static void print_result(const char *name, const char *params, double *samples, int count, const char *extra) {
+    double sum = 0;
+    qsort(samples, count, sizeof(double), compare_doubles);
+    for(int i = 0; i < count; i++) {
+        sum += samples[i];
+    }
+
+    printf("%s\n    {\"name\": \"%s\", \"params\": {%s}, \"unit\": \"ns/op\", \"reps\": %d, ",
+        first_result ? "" : ",", name, params, count);
+    printf("\"min\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f, \"mean\": %.2f",
+        samples[0], percentile(samples, count, 50), percentile(samples, count, 90),
+        percentile(samples, count, 99), samples[count - 1], sum / count);
+    if(extra) {
+        printf(", %s", extra);
+    }
+    printf("}");
+    first_result = false;
+}
+
+/*
+Allocates and frees batches of size byte blocks with physical memory filled
+to fill percent beforehand. The fill is left fragmented by freeing every other
+block of twice as much memory.
+*/
+static void bench_malloc_free(unsigned int size, int fill) {
+    unsigned int chunk = 16 * PGSIZE;
+    unsigned long num_chunks = PHYSICAL_MEM_SIZE / 100 * fill * 2 / chunk;
+    void **chunks = malloc((num_chunks + 1) * sizeof(void*));
+    unsigned long filled = 0;
+    for(; filled < num_chunks; filled++) {
+        chunks[filled] = t_malloc(chunk);
+        if(!chunks[filled]) {
+            break;
+        }
+    }
+    for(unsigned long i = 0; i < filled; i += 2) {
+        t_free(chunks[i], chunk);
+    }
+
+    //Keep each batch well inside the memory that is left
+    struct vm_stats stats;
+    t_vm_stats(&stats);
+    unsigned long batch = 256;
+    if(batch * size > stats.physical_free * PGSIZE / 4) {
+        batch = stats.physical_free * PGSIZE / 4 / size;
+    }
+    if(batch == 0) {
+        batch = 1;
+    }
+
+    void **blocks = malloc(batch * sizeof(void*));
+    double samples[MAX_REPS];
+    for(int rep = -warmup; rep < reps; rep++) {
+        double start = now_ns();
+        for(unsigned long i = 0; i < batch; i++) {
+            blocks[i] = t_malloc(size);
+        }
+        for(unsigned long i = 0; i < batch; i++) {
+            t_free(blocks[i], size);
+        }
+        if(rep >= 0) {
+            samples[rep] = (now_ns() - start) / (2 * batch);
+        }
+    }
+
+    char params[128];
+    snprintf(params, sizeof(params), "\"size\": %u, \"fill\": %d, \"batch\": %lu", size, fill, batch);
+    print_result("malloc_free", params, samples, reps, NULL);
+
+    for(unsigned long i = 1; i < filled; i += 2) {
+        t_free(chunks[i], chunk);
+    }
+    free(blocks);
+    free(chunks);
+}
+
+#define PATTERN_SEQUENTIAL 0
+#define PATTERN_STRIDED 1
+#define PATTERN_RANDOM 2
+
+/*
+Times 8 byte get_value or put_value calls over a buffer in one access pattern.
+Offsets are generated before timing so only the calls are measured.
+*/
+static void bench_access(int pattern, bool write) {
+    const char *pattern_names[] = { "sequential", "strided", "random" };
+    unsigned long size = 16UL * 1024 * 1024;
+    unsigned long stride = PGSIZE + 64;
+    char *buffer = t_malloc(size);
+    unsigned long *offsets = malloc(ops * sizeof(unsigned long));
+    for(unsigned long i = 0; i < ops; i++) {
+        if(pattern == PATTERN_SEQUENTIAL) {
+            offsets[i] = (i * 8) % size;
+        }
+        else if(pattern == PATTERN_STRIDED) {
+            offsets[i] = (i * stride) % (size - 8) & ~7UL;
+        }
+        else {
+            offsets[i] = next_random() % size & ~7UL;
+        }
+    }
+
+    unsigned long value = 0;
+    double samples[MAX_REPS];
+    for(int rep = -warmup; rep < reps; rep++) {
+        double start = now_ns();
+        for(unsigned long i = 0; i < ops; i++) {
+            if(write) {
+                put_value(buffer + offsets[i], &i, sizeof(unsigned long));
+            }
+            else {
+                get_value(buffer + offsets[i], &value, sizeof(unsigned long));
+            }
+        }
+        if(rep >= 0) {
+            samples[rep] = (now_ns() - start) / ops;
+        }
+    }
+
+    char params[128];
+    snprintf(params, sizeof(params), "\"pattern\": \"%s\", \"op\": \"%s\", \"bytes\": 8", pattern_names[pattern], write ? "put" : "get");
+    print_result("access", params, samples, reps, NULL);
+
+    t_free(buffer, size);
+    free(offsets);
+}
+
+/*
+Reads one value from a random page of a working set of size bytes per call,
+and reports the TLB hit rate next to the latency. With superpages off the set
+is mapped as single pages, otherwise t_malloc picks the mapping.
+*/
+static void bench_tlb(unsigned long size, bool superpages) {
+    //Reservations under demand paging never use superpages, the pages are
+    //then faulted in one at a time
+    set_demand_paging(!superpages);
+    char *buffer = t_malloc(size);
+    set_demand_paging(false);
+    unsigned long num_pages = size / PGSIZE;
+    for(unsigned long page = 0; page < num_pages; page++) {
+        put_value(buffer + page * PGSIZE, &page, sizeof(unsigned long));
+    }
+
+    unsigned long *offsets = malloc(ops * sizeof(unsigned long));
+    for(unsigned long i = 0; i < ops; i++) {
+        offsets[i] = next_random() % num_pages * PGSIZE;
+    }
+
+    unsigned long value;
+    unsigned long lookups = 0, misses = 0;
+    double samples[MAX_REPS];
+    for(int rep = -warmup; rep < reps; rep++) {
+        struct vm_stats before, after;
+        t_vm_stats(&before);
+        double start = now_ns();
+        for(unsigned long i = 0; i < ops; i++) {
+            get_value(buffer + offsets[i], &value, sizeof(unsigned long));
+        }
+        if(rep >= 0) {
+            samples[rep] = (now_ns() - start) / ops;
+            t_vm_stats(&after);
+            lookups += after.totals.tlb_lookups - before.totals.tlb_lookups;
+            misses += after.totals.tlb_misses - before.totals.tlb_misses;
+        }
+    }
+
+    char params[128], extra[64];
+    snprintf(params, sizeof(params), "\"working_set\": %lu, \"superpages\": %s", size, superpages ? "true" : "false");
+    snprintf(extra, sizeof(extra), "\"tlb_hit_rate\": %.4f", lookups ? 1 - (double) misses / lookups : 0);
+    print_result("tlb", params, samples, reps, extra);
+
+    t_free(buffer, size);
+    free(offsets);
+}
+
+/*
+Reads one value from every stride-th page of a 64 MB buffer mapped as single
+pages, with the TLB prefetcher at the given depth, and reports the TLB hit
+rate and prefetch accuracy next to the latency
+*/
+static void bench_tlb_stream(unsigned long stride, unsigned int depth) {
+    unsigned long size = 64UL << 20;
+    set_demand_paging(true);
+    char *buffer = t_malloc(size);
+    set_demand_paging(false);
+    for(unsigned long offset = 0; offset < size; offset += PGSIZE) {
+        put_value(buffer + offset, &offset, sizeof(unsigned long));
+    }
+    set_tlb_prefetch(depth);
+
+    unsigned long value;
+    unsigned long count = size / PGSIZE / stride;
+    unsigned long lookups = 0, misses = 0, prefetches = 0, prefetch_hits = 0;
+    double samples[MAX_REPS];
+    for(int rep = -warmup; rep < reps; rep++) {
+        struct vm_stats before, after;
+        t_vm_stats(&before);
+        double start = now_ns();
+        for(unsigned long i = 0; i < count; i++) {
+            get_value(buffer + i * stride * PGSIZE, &value, sizeof(unsigned long));
+        }
+        if(rep >= 0) {
+            samples[rep] = (now_ns() - start) / count;
+            t_vm_stats(&after);
+            lookups += after.totals.tlb_lookups - before.totals.tlb_lookups;
+            misses += after.totals.tlb_misses - before.totals.tlb_misses;
+            prefetches += after.totals.tlb_prefetches - before.totals.tlb_prefetches;
+            prefetch_hits += after.totals.tlb_prefetch_hits - before.totals.tlb_prefetch_hits;
+        }
+    }
+    set_tlb_prefetch(0);
+
+    char params[128], extra[128];
+    snprintf(params, sizeof(params), "\"stride_pages\": %lu, \"prefetch_depth\": %u", stride, depth);
+    snprintf(extra, sizeof(extra), "\"tlb_hit_rate\": %.4f, \"prefetch_accuracy\": %.4f",
+        lookups ? 1 - (double) misses / lookups : 0, prefetches ? (double) prefetch_hits / prefetches : 0);
+    print_result("tlb_stream", params, samples, reps, extra);
+
+    t_free(buffer, size);
+}
+
+/*
+Copies size bytes between two buffers, either with t_memcpy or by bouncing
+them through a host buffer with get_value and put_value
+*/
+static void bench_memcpy(unsigned long size, bool bounce) {
+    char *src = t_malloc(size);
+    char *dst = t_malloc(size);
+    char *host = malloc(size);
+    memset(host, 1, size);
+    put_value(src, host, size);
+
+    double samples[MAX_REPS];
+    for(int rep = -warmup; rep < reps; rep++) {
+        double start = now_ns();
+        if(bounce) {
+            get_value(src, host, size);
+            put_value(dst, host, size);
+        }
+        else {
+            t_memcpy(dst, src, size);
+        }
+        if(rep >= 0) {
+            samples[rep] = now_ns() - start;
+        }
+    }
+
+    char params[64];
+    snprintf(params, sizeof(params), "\"size\": %lu, \"bounce\": %s", size, bounce ? "true" : "false");
+    print_result("memcpy", params, samples, reps, NULL);
+
+    t_free(src, size);
+    t_free(dst, size);
+    free(host);
+}
+
+/*
+Doubles a size byte buffer allocated just before another page, so it usually
+has to move, either with t_realloc or with t_malloc, t_memcpy and t_free
+*/
+static void bench_realloc(unsigned long size, bool copy) {
+    char *host = malloc(size);
+    memset(host, 1, size);
+
+    double samples[MAX_REPS];
+    for(int rep = -warmup; rep < reps; rep++) {
+        char *buffer = t_malloc(size);
+        put_value(buffer, host, size);
+        char *blocker = t_malloc(PGSIZE);
+        double start = now_ns();
+        char *grown;
+        if(copy) {
+            grown = t_malloc(2 * size);
+            t_memcpy(grown, buffer, size);
+            t_free(buffer, size);
+        }
+        else {
+            grown = t_realloc(buffer, size, 2 * size);
+        }
+        if(rep >= 0) {
+            samples[rep] = now_ns() - start;
+        }
+        t_free(grown, 2 * size);
+        t_free(blocker, PGSIZE);
+    }
+
+    char params[64];
+    snprintf(params, sizeof(params), "\"size\": %lu, \"copy\": %s", size, copy ? "true" : "false");
+    print_result("realloc", params, samples, reps, NULL);
+
+    free(host);
+}
+
+/*
+Fills num_pages pages, every fourth with zeros and the others with only
+distinct different contents, and times one merge pass over them per repetition
+*/
+static void bench_merge(unsigned long num_pages, unsigned long distinct) {
+    unsigned long size = num_pages * PGSIZE;
+    int *page = malloc(PGSIZE);
+    unsigned long freed = 0;
+
+    double samples[MAX_REPS];
+    for(int rep = -warmup; rep < reps; rep++) {
+        char *buffer = t_malloc(size);
+        for(unsigned long i = 0; i < num_pages; i++) {
+            for(unsigned long j = 0; j < PGSIZE / sizeof(int); j++) {
+                page[j] = i % 4 ? (int) (i % distinct) + 1 : 0;
+            }
+            put_value(buffer + i * PGSIZE, page, PGSIZE);
+        }
+        double start = now_ns();
+        int merged = t_merge_pages();
+        if(rep >= 0) {
+            samples[rep] = (now_ns() - start) / num_pages;
+            freed += merged;
+        }
+        t_free(buffer, size);
+    }
+
+    char params[64], extra[64];
+    snprintf(params, sizeof(params), "\"pages\": %lu, \"distinct\": %lu", num_pages, distinct);
+    snprintf(extra, sizeof(extra), "\"frames_freed\": %lu", freed / reps);
+    print_result("merge", params, samples, reps, extra);
+
+    free(page);
+}
+
+/*
+Times mat_mult on size x size matrices of small integers
+*/
+static void bench_mat_mult(int size) {
+    unsigned long bytes = (unsigned long) size * size * sizeof(int);
+    void *a = t_malloc(bytes);
+    void *b = t_malloc(bytes);
+    void *c = t_malloc(bytes);
+    int *row = malloc(size * sizeof(int));
+    for(int i = 0; i < size; i++) {
+        for(int j = 0; j < size; j++) {
+            row[j] = next_random() % 16;
+        }
+        put_value(a + (unsigned long) i * size * sizeof(int), row, size * sizeof(int));
+        put_value(b + (unsigned long) i * size * sizeof(int), row, size * sizeof(int));
+    }
+
+    double samples[MAX_REPS];
+    for(int rep = -warmup; rep < reps; rep++) {
+        double start = now_ns();
+        mat_mult(a, b, size, c);
+        if(rep >= 0) {
+            samples[rep] = now_ns() - start;
+        }
+    }
+
+    char params[64];
+    snprintf(params, sizeof(params), "\"size\": %d", size);
+    print_result("mat_mult", params, samples, reps, NULL);
+
+    t_free(a, bytes);
+    t_free(b, bytes);
+    t_free(c, bytes);
+    free(row);
+}
+
+int main(int argc, char **argv) {
+    bool quick = false;
+    int opt;
+    while((opt = getopt(argc, argv, "r:w:q")) != -1) {
+        if(opt == 'r') {
+            reps = atoi(optarg);
+        }
+        else if(opt == 'w') {
+            warmup = atoi(optarg);
+        }
+        else if(opt == 'q') {
+            quick = true;
+        }
+        else {
+            fprintf(stderr, "usage: %s [-r reps] [-w warmup] [-q]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(reps < 1 || reps > MAX_REPS || warmup < 0) {
+        fprintf(stderr, "reps must be 1 to %d and warmup at least 0\n", MAX_REPS);
+        return 1;
+    }
+    if(quick) {
+        ops = 1 << 12;
+    }
+
+    set_physical_mem_size(PHYSICAL_MEM_SIZE, false);
+    //Set up physical memory before the first case reads the free frame count
+    t_free(t_malloc(1), 1);
+
+    printf("{\"config\": {\"reps\": %d, \"warmup\": %d, \"ops\": %lu, \"physical_mem\": %lu, \"page_size\": %d, \"va_bits\": %d, \"levels\": %d},\n",
+        reps, warmup, ops, PHYSICAL_MEM_SIZE, PGSIZE, VM_VA_BITS, VM_LEVELS);
+    printf(" \"results\": [");
+
+    unsigned int sizes[] = { 16, 256, 2048, 4096, 65536, 1024 * 1024 };
+    int fills[] = { 0, 50, 90 };
+    for(int f = 0; f < 3; f++) {
+        for(int s = 0; s < 6; s++) {
+            bench_malloc_free(sizes[s], fills[f]);
+        }
+    }
+
+    for(int pattern = PATTERN_SEQUENTIAL; pattern <= PATTERN_RANDOM; pattern++) {
+        bench_access(pattern, false);
+        bench_access(pattern, true);
+    }
+
+    unsigned long working_sets[] = { 64UL << 10, 256UL << 10, 1UL << 20, 4UL << 20, 16UL << 20, 64UL << 20 };
+    for(int w = 0; w < 6; w++) {
+        bench_tlb(working_sets[w], false);
+        bench_tlb(working_sets[w], true);
+    }
+
+    for(unsigned long stride = 1; stride <= 4; stride *= 4) {
+        bench_tlb_stream(stride, 0);
+        bench_tlb_stream(stride, 8);
+    }
+
+    unsigned long copy_sizes[] = { 256, 4096, 64UL << 10, 1UL << 20, 16UL << 20 };
+    for(int c = 0; c < (quick ? 4 : 5); c++) {
+        bench_memcpy(copy_sizes[c], false);
+        bench_memcpy(copy_sizes[c], true);
+    }
+
+    unsigned long realloc_sizes[] = { 64UL << 10, 1UL << 20, 16UL << 20 };
+    for(int r = 0; r < (quick ? 2 : 3); r++) {
+        bench_realloc(realloc_sizes[r], false);
+        bench_realloc(realloc_sizes[r], true);
+    }
+
+    for(unsigned long distinct = 1; distinct <= 4096; distinct *= 64) {
+        bench_merge(quick ? 1024 : 16384, distinct);
+    }
+
+    int mat_sizes[] = { 16, 64, 128, 256 };
+    for(int m = 0; m < (quick ? 3 : 4); m++) {
+        bench_mat_mult(mat_sizes[m]);
+    }
+
+    printf("\n]}\n");
+    return 0;
+}
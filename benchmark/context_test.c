@@ -0,0 +1,116 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../my_vm.h"
+
+#define NUM_INTS 3000
+#define SMALL_SIZE 64
+
+/*
+Checks that int i of the allocation at a in ctx holds i + tag, or -i + tag
+for every seventh int when changed is set
+*/
+int check(struct vm_context *ctx, int *a, int tag, bool changed) {
+    for (int i = 0; i < NUM_INTS; i++) {
+        int x, want = (changed && i % 7 == 0 ? -i : i) + tag;
+        if (t_vm_get_value(ctx, &a[i], &x, sizeof(int)) != 0 || x != want) {
+            printf("int %d is %d, expected %d\n", i, x, want);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+
+    int fails = 0;
+    int i, x;
+    char s[16];
+
+    printf("Creating two contexts and writing the same addresses in both\n");
+    struct vm_context *ctx1 = t_vm_create();
+    struct vm_context *ctx2 = t_vm_create();
+    if (!ctx1 || !ctx2) {
+        printf("contexts do not work\n");
+        return 1;
+    }
+    int *a1 = t_vm_malloc(ctx1, NUM_INTS * sizeof(int));
+    int *a2 = t_vm_malloc(ctx2, NUM_INTS * sizeof(int));
+    if (a1 != a2)
+        printf("Contexts handed out %lx and %lx\n", (unsigned long) a1, (unsigned long) a2);
+    for (i = 0; i < NUM_INTS; i++) {
+        x = i + 1;
+        t_vm_put_value(ctx1, &a1[i], &x, sizeof(int));
+        x = i + 2;
+        t_vm_put_value(ctx2, &a2[i], &x, sizeof(int));
+    }
+    if (check(ctx1, a1, 1, false) != 0 || check(ctx2, a2, 2, false) != 0)
+        fails++;
+
+    //A range is only mapped in the context that allocated it
+    char *only1 = t_vm_malloc(ctx1, SMALL_SIZE);
+    t_vm_put_value(ctx1, only1, "ctx1", 5);
+    if (t_vm_get_value(ctx2, only1, s, 5) == 0) {
+        printf("context 2 can read an allocation of context 1\n");
+        fails++;
+    }
+
+    printf("Forking context 1 and writing to both sides\n");
+    struct vm_stats stats;
+    t_vm_stats(&stats);
+    unsigned long cow_faults = stats.totals.counters.cow_faults;
+    struct vm_context *child = t_vm_fork(ctx1);
+    if (!child) {
+        printf("contexts do not work\n");
+        return 1;
+    }
+    if (check(child, a1, 1, false) != 0 || t_vm_get_value(child, only1, s, 5) != 0 || strcmp(s, "ctx1")) {
+        printf("child does not see the parent's values\n");
+        fails++;
+    }
+    for (i = 0; i < NUM_INTS; i += 7) {
+        x = -i + 1;
+        t_vm_put_value(child, &a1[i], &x, sizeof(int));
+    }
+    t_vm_put_value(ctx1, only1, "par1", 5);
+    t_vm_put_value(child, only1, "chi1", 5);
+    if (check(ctx1, a1, 1, false) != 0 || check(child, a1, 1, true) != 0) {
+        printf("writes after the fork leaked across\n");
+        fails++;
+    }
+    t_vm_get_value(ctx1, only1, s, 5);
+    if (strcmp(s, "par1")) {
+        printf("parent small object is \"%s\"\n", s);
+        fails++;
+    }
+    t_vm_get_value(child, only1, s, 5);
+    if (strcmp(s, "chi1")) {
+        printf("child small object is \"%s\"\n", s);
+        fails++;
+    }
+    t_vm_stats(&stats);
+    printf("Copy on write faults: %lu\n", stats.totals.counters.cow_faults - cow_faults);
+    if (stats.totals.counters.cow_faults == cow_faults) {
+        printf("the fork did not share frames copy on write\n");
+        fails++;
+    }
+
+    //Freeing and destroying one side leaves the other intact
+    printf("Destroying the child and context 2\n");
+    t_vm_free(child, a1, NUM_INTS * sizeof(int));
+    t_vm_destroy(child);
+    t_vm_destroy(ctx2);
+    if (check(ctx1, a1, 1, false) != 0)
+        fails++;
+    t_vm_free(ctx1, a1, NUM_INTS * sizeof(int));
+    t_vm_free(ctx1, only1, SMALL_SIZE);
+    t_vm_destroy(ctx1);
+
+    if (fails == 0)
+        printf("contexts work\n");
+    else
+        printf("contexts do not work\n");
+
+    return fails != 0;
+}
@@ -0,0 +1,121 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../my_vm.h"
+
+#define NUM_PAGES 3000
+#define SWAP_FILE "lz_test.swap"
+
+/*
+Fills a page with one of three kinds of contents: a short repeating pattern,
+text-like bytes with repeats at varying distances, or random bytes that do
+not compress
+*/
+void fill_page(unsigned int *page, int n, int kind) {
+    unsigned int seed = n;
+    for (int j = 0; j < PGSIZE / sizeof(int); j++) {
+        if (kind == 0)
+            page[j] = n * 7 + (j & 3);
+        else if (kind == 1)
+            page[j] = (j % 13 < 5) ? n : 'a' + (j * j + n) % 26;
+        else
+            page[j] = rand_r(&seed);
+    }
+}
+
+int round_trip(int n, int kind) {
+    unsigned int page[PGSIZE / sizeof(int)], back[PGSIZE / sizeof(int)];
+    unsigned char packed[ZPOOL_MAX_SIZE];
+    fill_page(page, n, kind);
+    unsigned int size = lz_compress((unsigned char*) page, PGSIZE, packed, ZPOOL_MAX_SIZE);
+    if (size == 0)
+        return kind == 2 ? 0 : -1;
+    if (kind == 2)
+        return -1;
+    if (lz_decompress(packed, size, (unsigned char*) back, PGSIZE) < 0)
+        return -1;
+    return memcmp(page, back, PGSIZE) == 0 ? 0 : -1;
+}
+
+int main() {
+
+    int fails = 0;
+    int i;
+
+    printf("Compressing and decompressing pages directly\n");
+    for (i = 0; i < 100; i++) {
+        for (int kind = 0; kind < 3; kind++) {
+            if (round_trip(i, kind) != 0) {
+                printf("round trip of page %d kind %d failed\n", i, kind);
+                fails++;
+            }
+        }
+    }
+    unsigned char zeros[PGSIZE] = {0}, packed[ZPOOL_MAX_SIZE], back[PGSIZE];
+    unsigned int size = lz_compress(zeros, PGSIZE, packed, ZPOOL_MAX_SIZE);
+    if (size == 0 || lz_decompress(packed, size, back, PGSIZE) < 0 || memcmp(zeros, back, PGSIZE)) {
+        printf("round trip of a zero page failed\n");
+        fails++;
+    }
+
+    printf("Setting up 4MB of memory, a 64KB compressed tier and a swap file\n");
+    if (set_physical_mem_size(4UL << 20, false) != 0 || set_swap_file(SWAP_FILE, 64UL << 20) != 0 ||
+        set_compressed_tier(64UL << 10) != 0) {
+        printf("compressed tier does not work\n");
+        return 1;
+    }
+
+    printf("Writing %d pages, a third of them incompressible\n", NUM_PAGES);
+    void **pages = malloc(NUM_PAGES * sizeof(void*));
+    unsigned int page[PGSIZE / sizeof(int)], back_page[PGSIZE / sizeof(int)];
+    for (i = 0; i < NUM_PAGES; i++) {
+        pages[i] = t_malloc(PGSIZE);
+        fill_page(page, i, i % 3);
+        if (!pages[i] || put_value(pages[i], page, PGSIZE) != 0) {
+            printf("could not write page %d\n", i);
+            fails++;
+            break;
+        }
+    }
+
+    printf("Reading every page back\n");
+    for (i = 0; i < NUM_PAGES && pages[i]; i++) {
+        fill_page(page, i, i % 3);
+        get_value(pages[i], back_page, PGSIZE);
+        if (memcmp(page, back_page, PGSIZE)) {
+            printf("page %d came back wrong\n", i);
+            fails++;
+            break;
+        }
+    }
+
+    //Incompressible pages are rejected by the pool and pages that no longer
+    //fit in it go to the swap file, so both paths must have been taken
+    struct vm_stats stats;
+    t_vm_stats(&stats);
+    printf("Pool stores %lu, rejects %lu, loads %lu, swap outs %lu\n", stats.zpool_stores, stats.zpool_rejects,
+           stats.totals.counters.zpool_loads, stats.swap_outs);
+    if (stats.zpool_stores == 0 || stats.totals.counters.zpool_loads == 0 || stats.zpool_rejects == 0 ||
+        stats.swap_outs <= stats.zpool_rejects) {
+        printf("not every path was taken\n");
+        fails++;
+    }
+
+    for (i = 0; i < NUM_PAGES && pages[i]; i++)
+        t_free(pages[i], PGSIZE);
+    free(pages);
+    t_vm_stats(&stats);
+    if (stats.zpool_pages != 0) {
+        printf("%lu pages left in the pool after freeing\n", stats.zpool_pages);
+        fails++;
+    }
+    remove(SWAP_FILE);
+
+    if (fails == 0)
+        printf("compressed tier works\n");
+    else
+        printf("compressed tier does not work\n");
+
+    return fails != 0;
+}
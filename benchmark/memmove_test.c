@@ -0,0 +1,87 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../my_vm.h"
+
+#define NUM_PAGES 4
+#define SIZE (NUM_PAGES * PGSIZE)
+
+unsigned char expected[SIZE];
+
+/*
+Refills the allocation and the local copy with the same byte pattern
+*/
+void reset(void *a) {
+    for (int i = 0; i < SIZE; i++)
+        expected[i] = (i * 7 + i / PGSIZE) & 0xff;
+    put_value(a, expected, SIZE);
+}
+
+int compare(void *a, const char *what) {
+    static unsigned char back[SIZE];
+    get_value(a, back, SIZE);
+    for (int i = 0; i < SIZE; i++) {
+        if (back[i] != expected[i]) {
+            printf("%s: byte %d is %d, expected %d\n", what, i, back[i], expected[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+
+    int fails = 0;
+
+    printf("Allocating %d pages\n", NUM_PAGES);
+    char *a = t_malloc(SIZE);
+
+    //Moves that overlap in both directions, within a page and across page
+    //boundaries, must match memmove on a local copy
+    struct { unsigned long dst, src, n; } moves[] = {
+        {10, 0, 100},
+        {0, 10, 100},
+        {PGSIZE - 50, PGSIZE - 300, 2 * PGSIZE},
+        {PGSIZE - 300, PGSIZE - 50, 2 * PGSIZE},
+        {1, 0, SIZE - 1},
+        {0, 1, SIZE - 1},
+        {PGSIZE, 0, 3 * PGSIZE},
+        {0, PGSIZE, 3 * PGSIZE},
+    };
+    for (int i = 0; i < sizeof(moves) / sizeof(moves[0]); i++) {
+        char what[64];
+        snprintf(what, sizeof(what), "move of %lu bytes from %lu to %lu", moves[i].n, moves[i].src, moves[i].dst);
+        printf("Checking the %s\n", what);
+        reset(a);
+        if (t_memmove(a + moves[i].dst, a + moves[i].src, moves[i].n) != 0) {
+            printf("%s failed\n", what);
+            fails++;
+            continue;
+        }
+        memmove(expected + moves[i].dst, expected + moves[i].src, moves[i].n);
+        if (compare(a, what) != 0)
+            fails++;
+    }
+
+    printf("Checking t_memcpy, t_memset and a move past the end\n");
+    reset(a);
+    t_memcpy(a, a + 2 * PGSIZE + 5, PGSIZE);
+    memcpy(expected, expected + 2 * PGSIZE + 5, PGSIZE);
+    t_memset(a + PGSIZE + 100, 0xab, PGSIZE);
+    memset(expected + PGSIZE + 100, 0xab, PGSIZE);
+    if (compare(a, "copy and set") != 0)
+        fails++;
+    if (t_memmove(a + PGSIZE, a, SIZE) == 0 || compare(a, "failed move") != 0) {
+        printf("a move past the end was not rejected untouched\n");
+        fails++;
+    }
+    t_free(a, SIZE);
+
+    if (fails == 0)
+        printf("memmove works\n");
+    else
+        printf("memmove does not work\n");
+
+    return fails != 0;
+}
@@ -0,0 +1,92 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../my_vm.h"
+
+#define NUM_PAGES 32
+
+/*
+Page n of the test holds zeros if it is one of the first quarter, one shared
+pattern if it is in the second quarter and a pattern of its own otherwise
+*/
+unsigned int expected(int n, int j) {
+    if (n < NUM_PAGES / 4)
+        return 0;
+    if (n < NUM_PAGES / 2)
+        return 0xabcd0000 + j;
+    return n * 1000 + j;
+}
+
+int check_pages(void **pages, int written, unsigned int value) {
+    unsigned int page[PGSIZE / sizeof(int)];
+    for (int i = 0; i < NUM_PAGES; i++) {
+        get_value(pages[i], page, PGSIZE);
+        for (int j = 0; j < PGSIZE / sizeof(int); j++) {
+            unsigned int want = (i == written && j == 0) ? value : expected(i, j);
+            if (page[j] != want) {
+                printf("page %d holds %x at %d, expected %x\n", i, page[j], j, want);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main() {
+
+    int fails = 0;
+    int i, j;
+    unsigned int page[PGSIZE / sizeof(int)];
+
+    printf("Writing %d pages: zeros, one repeated pattern and unique ones\n", NUM_PAGES);
+    void **pages = malloc(NUM_PAGES * sizeof(void*));
+    for (i = 0; i < NUM_PAGES; i++) {
+        pages[i] = t_malloc(PGSIZE);
+        for (j = 0; j < PGSIZE / sizeof(int); j++)
+            page[j] = expected(i, j);
+        put_value(pages[i], page, PGSIZE);
+    }
+
+    printf("Merging identical pages\n");
+    int freed = t_merge_pages();
+    struct vm_stats stats;
+    t_vm_stats(&stats);
+    printf("Freed %d frames, %lu merged, %lu onto the zero page\n", freed, stats.pages_merged, stats.zero_pages_merged);
+    if (stats.zero_pages_merged < NUM_PAGES / 4 || stats.pages_merged < NUM_PAGES / 4 - 1) {
+        printf("pages were not merged\n");
+        fails++;
+    }
+    if (check_pages(pages, -1, 0) != 0)
+        fails++;
+
+    //Writes to a merged page split it off again and leave its twins alone
+    printf("Writing to a zero page and a merged page\n");
+    unsigned long cow_faults = stats.totals.counters.cow_faults;
+    unsigned int value = 0x1234;
+    put_value(pages[1], &value, sizeof(int));
+    if (check_pages(pages, 1, value) != 0)
+        fails++;
+    value = 0;
+    put_value(pages[1], &value, sizeof(int));
+    value = 0x5678;
+    put_value(pages[NUM_PAGES / 4 + 1], &value, sizeof(int));
+    if (check_pages(pages, NUM_PAGES / 4 + 1, value) != 0)
+        fails++;
+    t_vm_stats(&stats);
+    if (stats.totals.counters.cow_faults < cow_faults + 2) {
+        printf("writes did not split the merged pages\n");
+        fails++;
+    }
+
+    for (i = 0; i < NUM_PAGES; i++)
+        t_free(pages[i], PGSIZE);
+    free(pages);
+
+    if (fails == 0)
+        printf("page merging works\n");
+    else
+        printf("page merging does not work\n");
+
+    return fails != 0;
+}
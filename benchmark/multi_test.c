@@ -19,7 +19,7 @@ void *put_mem(void *id_arg) {
     void *va_pointer = pointers[*((int *)id_arg)];
     for (int i = 0; i < matrix_size; i++) {
         for (int j = 0; j < matrix_size; j++) {
-            int address_a = (unsigned int)va_pointer + ((i * matrix_size * sizeof(int))) + (j * sizeof(int));
+            unsigned long address_a = (unsigned long)va_pointer + ((i * matrix_size * sizeof(int))) + (j * sizeof(int));
             put_value((void *)address_a, &val, sizeof(int));
 	    //val++;
         }
@@ -55,7 +55,7 @@ int main() {
 
     printf("Allocated Pointers: \n");
     for (int i = 0; i < num_threads; i++)
-        printf("%x ", (int)pointers[i]);
+        printf("%lx ", (unsigned long)pointers[i]);
     printf("\n");
     
     printf("initializing some of the memory by in multiple threads\n");
@@ -71,7 +71,7 @@ int main() {
     int val = 0;
     for (int i = 0; i < matrix_size; i++) {
         for (int j = 0; j < matrix_size; j++) {
-            int address_a = (unsigned int)a + ((i * matrix_size * sizeof(int))) + (j * sizeof(int));
+            unsigned long address_a = (unsigned long)a + ((i * matrix_size * sizeof(int))) + (j * sizeof(int));
             get_value((void *)address_a, &val, sizeof(int));
             printf("%d ", val);
         }
@@ -93,13 +93,13 @@ int main() {
 
     for (int i = 0; i < matrix_size; i++) {
         for (int j = 0; j < matrix_size; j++) {
-            int address_a = (unsigned int)a + ((i * matrix_size * sizeof(int))) + (j * sizeof(int));
+            unsigned long address_a = (unsigned long)a + ((i * matrix_size * sizeof(int))) + (j * sizeof(int));
             get_value((void *)address_a, &val, sizeof(int));
             printf("%d ", val);
         }
         printf("\n");
     }
-    int old = (int)pointers[0];
+    unsigned long old = (unsigned long)pointers[0];
     printf("Gonna free everything in multiple threads!\n");
     // ufree(pointers[0], alloc_size);
     //
@@ -113,7 +113,7 @@ int main() {
     int flag = 0;
     while (temp != NULL) {
         temp = t_malloc(10);
-        if ((int)temp == old) {
+        if ((unsigned long)temp == old) {
             printf("Free Worked!\n");
             flag = 1;
             break;
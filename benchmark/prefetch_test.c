@@ -0,0 +1,74 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "../my_vm.h"
+
+#define NUM_PAGES 96
+#define DEPTH 8
+
+/*
+Reads every stride-th page of the allocation at a from a flushed TLB with the
+prefetcher at depth, and reports the misses and prefetch hits of the pass
+*/
+void stream(void *a, int stride, unsigned int depth, unsigned long *misses, unsigned long *hits) {
+    struct vm_stats before, after;
+    int x;
+
+    set_tlb_prefetch(depth);
+    set_tlb_config(TLB_ENTRIES, TLB_WAYS, TLB_POLICY_LRU);
+    t_vm_stats(&before);
+    for (int i = 0; i < NUM_PAGES; i += stride)
+        get_value((char*) a + (unsigned long) i * PGSIZE, &x, sizeof(int));
+    t_vm_stats(&after);
+    *misses = after.totals.tlb_misses - before.totals.tlb_misses;
+    *hits = after.totals.tlb_prefetch_hits - before.totals.tlb_prefetch_hits;
+    printf("Stride %d, depth %u: %lu misses, %lu prefetch hits\n", stride, depth, *misses, *hits);
+}
+
+int main() {
+
+    int fails = 0;
+    unsigned long misses, hits;
+
+    printf("Allocating and writing %d pages\n", NUM_PAGES);
+    void *a = t_malloc(NUM_PAGES * PGSIZE);
+    for (int i = 0; i < NUM_PAGES; i++)
+        put_value((char*) a + (unsigned long) i * PGSIZE, &i, sizeof(int));
+
+    //Without the prefetcher every page of the stream misses
+    stream(a, 1, 0, &misses, &hits);
+    if (misses < NUM_PAGES || hits != 0) {
+        printf("unexpected misses or hits with the prefetcher off\n");
+        fails++;
+    }
+
+    //Once two misses confirm a stride, the rest of the stream should be
+    //filled ahead of the reads
+    for (int stride = 1; stride <= 3; stride++) {
+        int reads = (NUM_PAGES + stride - 1) / stride;
+        stream(a, stride, DEPTH, &misses, &hits);
+        if (misses > 3 || hits < reads - 3) {
+            printf("the prefetcher did not follow a stride of %d\n", stride);
+            fails++;
+        }
+    }
+
+    struct vm_stats stats;
+    t_vm_stats(&stats);
+    printf("Prefetch accuracy %lf, coverage %lf\n", stats.prefetch_accuracy, stats.prefetch_coverage);
+    if (stats.prefetch_accuracy <= 0 || stats.prefetch_coverage <= 0)
+        fails++;
+    if (set_tlb_prefetch(TLB_PREFETCH_MAX_DEPTH + 1) == 0) {
+        printf("a prefetch depth above the maximum was accepted\n");
+        fails++;
+    }
+    set_tlb_prefetch(0);
+    t_free(a, NUM_PAGES * PGSIZE);
+
+    if (fails == 0)
+        printf("TLB prefetching works\n");
+    else
+        printf("TLB prefetching does not work\n");
+
+    return fails != 0;
+}
@@ -0,0 +1,111 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "../my_vm.h"
+
+#define NUM_READERS 4
+#define NUM_ROUNDS 50
+#define NUM_PAGES 16
+#define SENTINEL 0x5e5e5e5e
+
+pthread_barrier_t barrier;
+void *stable;
+void *racing;
+int round_tag;
+int fails[NUM_READERS];
+int ids[NUM_READERS];
+
+/*
+Reads one page at a time from the range the main thread is freeing. Each read
+must return the whole page as it was written, nothing at all, or a fresh zero
+page, never a mix of them. Reads of the stable allocation must never fail.
+*/
+void *reader(void *arg) {
+    int id = *((int*) arg);
+    unsigned int page[PGSIZE / sizeof(int)];
+    int x;
+
+    for (int r = 0; r < NUM_ROUNDS; r++) {
+        pthread_barrier_wait(&barrier);
+        for (int n = 0; n < NUM_PAGES * 4; n++) {
+            int i = (n + id) % NUM_PAGES;
+            for (int j = 0; j < PGSIZE / sizeof(int); j++)
+                page[j] = SENTINEL;
+            get_value((char*) racing + (unsigned long) i * PGSIZE, page, PGSIZE);
+            unsigned int first = page[0];
+            if (first != round_tag + i && first != SENTINEL && first != 0) {
+                printf("round %d page %d starts with %x\n", r, i, first);
+                fails[id]++;
+            }
+            for (int j = 1; j < PGSIZE / sizeof(int); j++) {
+                if (page[j] != first) {
+                    printf("round %d page %d is torn at %d\n", r, i, j);
+                    fails[id]++;
+                    break;
+                }
+            }
+
+            x = -1;
+            get_value((char*) stable + (unsigned long) i * sizeof(int), &x, sizeof(int));
+            if (x != i) {
+                printf("stable int %d read as %d\n", i, x);
+                fails[id]++;
+            }
+        }
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+int main() {
+
+    pthread_t threads[NUM_READERS];
+    unsigned int page[PGSIZE / sizeof(int)];
+    int i, j, r, x;
+
+    printf("Starting %d readers against %d rounds of t_free\n", NUM_READERS, NUM_ROUNDS);
+    stable = t_malloc(NUM_PAGES * sizeof(int));
+    for (i = 0; i < NUM_PAGES; i++) {
+        x = i;
+        put_value((char*) stable + i * sizeof(int), &x, sizeof(int));
+    }
+    pthread_barrier_init(&barrier, NULL, NUM_READERS + 1);
+    for (i = 0; i < NUM_READERS; i++) {
+        ids[i] = i;
+        pthread_create(&threads[i], NULL, reader, &ids[i]);
+    }
+
+    //Each round fills a fresh range, lets the readers at it and frees it
+    //under them. Nothing is allocated until they are done, so a read that
+    //outlives the free can only see the old frames.
+    for (r = 0; r < NUM_ROUNDS; r++) {
+        racing = t_malloc(NUM_PAGES * PGSIZE);
+        round_tag = (r + 1) << 16;
+        for (i = 0; i < NUM_PAGES; i++) {
+            for (j = 0; j < PGSIZE / sizeof(int); j++)
+                page[j] = round_tag + i;
+            put_value((char*) racing + (unsigned long) i * PGSIZE, page, PGSIZE);
+        }
+        pthread_barrier_wait(&barrier);
+        t_free(racing, NUM_PAGES * PGSIZE);
+        if (put_value(racing, &x, sizeof(int)) == 0) {
+            printf("put_value succeeded on a freed page\n");
+            fails[0]++;
+        }
+        pthread_barrier_wait(&barrier);
+    }
+
+    int total = 0;
+    for (i = 0; i < NUM_READERS; i++) {
+        pthread_join(threads[i], NULL);
+        total += fails[i];
+    }
+    t_free(stable, NUM_PAGES * sizeof(int));
+
+    if (total == 0)
+        printf("lock-free reads work\n");
+    else
+        printf("lock-free reads do not work\n");
+
+    return total != 0;
+}
@@ -0,0 +1,93 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../my_vm.h"
+
+#define SMALL_SIZE 100
+
+/*
+Writes ints start to end - 1 of an allocation with their own index plus tag
+*/
+void fill(void *va, int start, int end, int tag) {
+    for (int i = start; i < end; i++) {
+        int x = i + tag;
+        put_value((char*) va + i * sizeof(int), &x, sizeof(int));
+    }
+}
+
+int check(void *va, int start, int end, int tag) {
+    for (int i = start; i < end; i++) {
+        int x;
+        get_value((char*) va + i * sizeof(int), &x, sizeof(int));
+        if (x != i + tag) {
+            printf("int %d is %d, expected %d\n", i, x, i + tag);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+
+    int fails = 0;
+    int ints_per_page = PGSIZE / sizeof(int);
+    struct vm_stats stats;
+
+    printf("Growing a 2 page allocation to 4 pages\n");
+    void *a = t_malloc(2 * PGSIZE);
+    fill(a, 0, 2 * ints_per_page, 1);
+    void *grown = t_realloc(a, 2 * PGSIZE, 4 * PGSIZE);
+    if (grown != a) {
+        printf("allocation moved although the next pages were free\n");
+        fails++;
+    }
+    if (!grown || check(grown, 0, 2 * ints_per_page, 1) != 0) {
+        fails++;
+        grown = a;
+    }
+    fill(grown, 2 * ints_per_page, 4 * ints_per_page, 1);
+
+    //An allocation right behind it leaves no room to grow, so the pages
+    //have to be remapped to a new range
+    printf("Growing it to 16 pages with the next page taken\n");
+    void *b = t_malloc(PGSIZE);
+    fill(b, 0, ints_per_page, 2);
+    t_vm_stats(&stats);
+    unsigned long remapped = stats.totals.counters.pages_remapped;
+    void *moved = t_realloc(grown, 4 * PGSIZE, 16 * PGSIZE);
+    t_vm_stats(&stats);
+    printf("Moved from %lx to %lx, %lu pages remapped\n", (unsigned long) grown, (unsigned long) moved,
+           stats.totals.counters.pages_remapped - remapped);
+    if (!moved || moved == grown || stats.totals.counters.pages_remapped - remapped != 4) {
+        printf("allocation was not moved by remapping\n");
+        fails++;
+    }
+    if (!moved || check(moved, 0, 4 * ints_per_page, 1) != 0 || check(b, 0, ints_per_page, 2) != 0)
+        fails++;
+
+    printf("Shrinking it back to 1 page\n");
+    if (moved) {
+        void *shrunk = t_realloc(moved, 16 * PGSIZE, PGSIZE);
+        if (shrunk != moved || check(shrunk, 0, ints_per_page, 1) != 0)
+            fails++;
+        t_free(shrunk, PGSIZE);
+    }
+
+    printf("Growing a %d byte object onto its own pages\n", SMALL_SIZE);
+    void *s = t_malloc(SMALL_SIZE);
+    fill(s, 0, SMALL_SIZE / sizeof(int), 3);
+    void *big = t_realloc(s, SMALL_SIZE, 3 * PGSIZE);
+    if (!big || check(big, 0, SMALL_SIZE / sizeof(int), 3) != 0)
+        fails++;
+    else
+        t_free(big, 3 * PGSIZE);
+    t_free(b, PGSIZE);
+
+    if (fails == 0)
+        printf("realloc works\n");
+    else
+        printf("realloc does not work\n");
+
+    return fails != 0;
+}
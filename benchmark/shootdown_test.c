@@ -0,0 +1,89 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "../my_vm.h"
+
+#define NUM_PAGES 4
+
+extern struct vm_context default_context;
+
+pthread_barrier_t barrier;
+void *a;
+int fails = 0;
+
+/*
+Caches translations of every page in this thread's TLB, then checks that the
+main thread's t_free shot them down and that the pages it reallocated read
+back what it wrote instead of the old values
+*/
+void *reader(void *arg) {
+    int x;
+    for (int i = 0; i < NUM_PAGES; i++) {
+        x = i;
+        put_value((char*) a + (unsigned long) i * PGSIZE, &x, sizeof(int));
+        if (!check_TLB(&default_context, (char*) a + (unsigned long) i * PGSIZE, NULL)) {
+            printf("page %d was not cached by the reader\n", i);
+            fails++;
+        }
+    }
+    pthread_barrier_wait(&barrier);
+
+    //The main thread frees the pages here
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < NUM_PAGES; i++) {
+        if (check_TLB(&default_context, (char*) a + (unsigned long) i * PGSIZE, NULL)) {
+            printf("page %d is still cached by the reader after t_free\n", i);
+            fails++;
+        }
+    }
+    pthread_barrier_wait(&barrier);
+
+    //The main thread reallocates and writes the pages here
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < NUM_PAGES; i++) {
+        get_value((char*) a + (unsigned long) i * PGSIZE, &x, sizeof(int));
+        if (x != 100 + i) {
+            printf("reader sees %d in page %d, expected %d\n", x, i, 100 + i);
+            fails++;
+        }
+    }
+    return NULL;
+}
+
+int main() {
+
+    pthread_t thread;
+    int x;
+
+    printf("Allocating %d pages and caching them in a second thread\n", NUM_PAGES);
+    a = t_malloc(NUM_PAGES * PGSIZE);
+    pthread_barrier_init(&barrier, NULL, 2);
+    pthread_create(&thread, NULL, reader, NULL);
+    pthread_barrier_wait(&barrier);
+
+    printf("Freeing them in the main thread\n");
+    t_free(a, NUM_PAGES * PGSIZE);
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+
+    printf("Reallocating them with new values\n");
+    void *b = t_malloc(NUM_PAGES * PGSIZE);
+    if (b != a) {
+        printf("freed pages were not reused\n");
+        fails++;
+    }
+    for (int i = 0; i < NUM_PAGES; i++) {
+        x = 100 + i;
+        put_value((char*) b + (unsigned long) i * PGSIZE, &x, sizeof(int));
+    }
+    pthread_barrier_wait(&barrier);
+    pthread_join(thread, NULL);
+    t_free(b, NUM_PAGES * PGSIZE);
+
+    if (fails == 0)
+        printf("TLB shootdown works\n");
+    else
+        printf("TLB shootdown does not work\n");
+
+    return fails != 0;
+}
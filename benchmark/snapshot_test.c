@@ -0,0 +1,80 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../my_vm.h"
+
+#define NUM_INTS 3000
+#define SMALL_SIZE 64
+
+int main() {
+
+    int fails = 0;
+    int i, x, y;
+
+    printf("Allocating %lu bytes over several pages and a %d byte object\n", NUM_INTS * sizeof(int), SMALL_SIZE);
+    int *a = t_malloc(NUM_INTS * sizeof(int));
+    char *s = t_malloc(SMALL_SIZE);
+    for (i = 0; i < NUM_INTS; i++) {
+        x = i;
+        put_value(&a[i], &x, sizeof(int));
+    }
+    put_value(s, "before", 7);
+
+    printf("Taking a snapshot\n");
+    struct vm_snapshot *snap = t_snapshot();
+    if (!snap) {
+        printf("snapshot does not work\n");
+        return 1;
+    }
+
+    printf("Writing new values after the snapshot\n");
+    for (i = 0; i < NUM_INTS; i += 7) {
+        x = -i;
+        put_value(&a[i], &x, sizeof(int));
+    }
+    put_value(s, "after!", 7);
+
+    printf("Checking the live values and the snapshot\n");
+    for (i = 0; i < NUM_INTS; i++) {
+        get_value(&a[i], &x, sizeof(int));
+        if (t_snapshot_get(snap, &a[i], &y, sizeof(int)) != 0 || y != i) {
+            printf("snapshot changed at %d: %d\n", i, y);
+            fails++;
+            break;
+        }
+        if (x != (i % 7 == 0 ? -i : i)) {
+            printf("live value wrong at %d: %d\n", i, x);
+            fails++;
+            break;
+        }
+    }
+    char old[7], new[7];
+    get_value(s, new, 7);
+    if (t_snapshot_get(snap, s, old, 7) != 0 || strcmp(old, "before") || strcmp(new, "after!")) {
+        printf("small object wrong: snapshot \"%s\", live \"%s\"\n", old, new);
+        fails++;
+    }
+
+    printf("Freeing the allocations, the snapshot keeps its copy\n");
+    t_free(a, NUM_INTS * sizeof(int));
+    t_free(s, SMALL_SIZE);
+    if (t_snapshot_get(snap, &a[NUM_INTS - 1], &y, sizeof(int)) != 0 || y != NUM_INTS - 1) {
+        printf("snapshot lost a freed page\n");
+        fails++;
+    }
+    t_snapshot_free(snap);
+
+    struct vm_stats stats;
+    t_vm_stats(&stats);
+    printf("Copy on write faults: %lu\n", stats.totals.counters.cow_faults);
+    if (stats.totals.counters.cow_faults == 0)
+        fails++;
+
+    if (fails == 0)
+        printf("snapshot works\n");
+    else
+        printf("snapshot does not work\n");
+
+    return fails != 0;
+}
@@ -0,0 +1,341 @@
+#include "../my_vm.h"
+#include <time.h>
+#include <math.h>
+
+//Multi-threaded stress harness. Runs the same mixed workload with 1, 2, 4 ...
+//up to the maximum number of threads and prints one JSON result per thread
+//count with throughput, latency percentiles per operation and the time the
+//threads spent waiting on the VM lock.
+//
+//  ./stress [-t threads] [-n ops] [-m read,write,alloc,free] [-s size] [-k keys] [-z skew] [-b bytes]
+//
+//Reads and writes go to a shared set of keys, one page each, picked with a
+//zipf distribution of the given skew, 0 is uniform. Allocations and frees
+//work on blocks private to each thread. A size of N allocates N bytes every
+//time, MIN-MAX picks log uniformly between the two.
+
+#define PHYSICAL_MEM_SIZE (512UL * 1024 * 1024)
+#define LIVE_BLOCKS 64
+
+#define OP_READ 0
+#define OP_WRITE 1
+#define OP_ALLOC 2
+#define OP_FREE 3
+#define NUM_OPS 4
+
+const char *op_names[NUM_OPS] = { "read", "write", "alloc", "free" };
+
+int max_threads = 8;
+unsigned long ops = 100000;
+unsigned int mix[NUM_OPS] = { 70, 20, 5, 5 };
+unsigned int min_size = 16;
+unsigned int max_size = 16384;
+unsigned long num_keys = 4096;
+double skew = 0;
+unsigned int access_bytes = 8;
+
+char *keys;
+double *key_cdf;
+pthread_barrier_t ready, go;
+
+//Structure to represent what one worker thread did in a run
+typedef struct worker {
+    pthread_t thread;
+    unsigned long rng_state;
+    unsigned long count[NUM_OPS];
+    unsigned int *latency[NUM_OPS];
+    unsigned long failed;
+}worker;
+
+static unsigned long next_random(struct worker *worker) {
+    worker->rng_state ^= worker->rng_state << 13;
+    worker->rng_state ^= worker->rng_state >> 7;
+    worker->rng_state ^= worker->rng_state << 17;
+    return worker->rng_state;
+}
+
+static double next_uniform(struct worker *worker) {
+    return (next_random(worker) >> 11) * (1.0 / (1UL << 53));
+}
+
+static unsigned long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static int compare_uints(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int*) a;
+    unsigned int y = *(const unsigned int*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+Builds the cumulative distribution of key popularity. Key i is picked with
+weight 1 / (i + 1)^skew.
+*/
+static void init_keys() {
+    key_cdf = malloc(num_keys * sizeof(double));
+    double sum = 0;
+    for(unsigned long i = 0; i < num_keys; i++) {
+        sum += 1 / pow(i + 1, skew);
+        key_cdf[i] = sum;
+    }
+    for(unsigned long i = 0; i < num_keys; i++) {
+        key_cdf[i] /= sum;
+    }
+}
+
+static unsigned long pick_key(struct worker *worker) {
+    double u = next_uniform(worker);
+    unsigned long low = 0, high = num_keys - 1;
+    while(low < high) {
+        unsigned long mid = (low + high) / 2;
+        if(key_cdf[mid] < u) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static unsigned int pick_size(struct worker *worker) {
+    if(min_size == max_size) {
+        return min_size;
+    }
+    return (unsigned int) (min_size * pow((double) max_size / min_size, next_uniform(worker)));
+}
+
+static int pick_op(struct worker *worker) {
+    unsigned int roll = next_random(worker) % 100;
+    for(int op = 0; op < NUM_OPS - 1; op++) {
+        if(roll < mix[op]) {
+            return op;
+        }
+        roll -= mix[op];
+    }
+    return NUM_OPS - 1;
+}
+
+/*
+Runs ops operations, after as many untimed ones to warm up. Allocation and
+free swap roles when the thread has no block to free or no room for another.
+*/
+static void *run_worker(void *arg) {
+    struct worker *worker = arg;
+    void *blocks[LIVE_BLOCKS];
+    unsigned int sizes[LIVE_BLOCKS];
+    int live = 0;
+    unsigned long value = 0;
+
+    for(int phase = 0; phase < 2; phase++) {
+        if(phase == 1) {
+            pthread_barrier_wait(&ready);
+            pthread_barrier_wait(&go);
+        }
+        for(unsigned long i = 0; i < ops; i++) {
+            int op = pick_op(worker);
+            if(op == OP_ALLOC && live == LIVE_BLOCKS) {
+                op = OP_FREE;
+            }
+            else if(op == OP_FREE && live == 0) {
+                op = OP_ALLOC;
+            }
+
+            unsigned long start = now_ns();
+            if(op == OP_READ || op == OP_WRITE) {
+                char *va = keys + pick_key(worker) * PGSIZE;
+                va += next_random(worker) % (PGSIZE - access_bytes + 1);
+                if(op == OP_READ) {
+                    get_value(va, &value, access_bytes);
+                }
+                else {
+                    put_value(va, &value, access_bytes);
+                }
+            }
+            else if(op == OP_ALLOC) {
+                sizes[live] = pick_size(worker);
+                blocks[live] = t_malloc(sizes[live]);
+                if(blocks[live]) {
+                    live++;
+                }
+                else if(phase == 1) {
+                    worker->failed++;
+                }
+            }
+            else {
+                int victim = next_random(worker) % live;
+                t_free(blocks[victim], sizes[victim]);
+                live--;
+                blocks[victim] = blocks[live];
+                sizes[victim] = sizes[live];
+            }
+            if(phase == 1) {
+                worker->latency[op][worker->count[op]++] = now_ns() - start;
+            }
+        }
+    }
+
+    while(live > 0) {
+        live--;
+        t_free(blocks[live], sizes[live]);
+    }
+    return NULL;
+}
+
+/*
+Prints the percentiles of all latencies of one operation and frees them
+*/
+static void print_latency(struct worker *workers, int num_threads, int op) {
+    unsigned long total = 0;
+    for(int t = 0; t < num_threads; t++) {
+        total += workers[t].count[op];
+    }
+    printf("\"%s\": {\"ops\": %lu", op_names[op], total);
+    if(total > 0) {
+        unsigned int *all = malloc(total * sizeof(unsigned int));
+        unsigned long next = 0;
+        for(int t = 0; t < num_threads; t++) {
+            memcpy(all + next, workers[t].latency[op], workers[t].count[op] * sizeof(unsigned int));
+            next += workers[t].count[op];
+        }
+        qsort(all, total, sizeof(unsigned int), compare_uints);
+        printf(", \"p50_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u, \"max_ns\": %u",
+            all[total / 2], all[total * 99 / 100], all[total * 999 / 1000], all[total - 1]);
+        free(all);
+    }
+    printf("}");
+}
+
+/*
+Runs the workload with num_threads threads and prints its result
+*/
+static void run(int num_threads, bool first) {
+    struct worker *workers = calloc(num_threads, sizeof(struct worker));
+    pthread_barrier_init(&ready, NULL, num_threads + 1);
+    pthread_barrier_init(&go, NULL, num_threads + 1);
+    for(int t = 0; t < num_threads; t++) {
+        workers[t].rng_state = 0x9e3779b97f4a7c15UL * (t + 1);
+        for(int op = 0; op < NUM_OPS; op++) {
+            workers[t].latency[op] = malloc(ops * sizeof(unsigned int));
+        }
+        pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+    }
+
+    //Every worker is warmed up and waiting, so the counters are quiet
+    struct vm_stats before, after;
+    pthread_barrier_wait(&ready);
+    t_vm_stats(&before);
+    unsigned long start = now_ns();
+    pthread_barrier_wait(&go);
+    for(int t = 0; t < num_threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    unsigned long elapsed = now_ns() - start;
+    t_vm_stats(&after);
+
+    unsigned long failed = 0;
+    for(int t = 0; t < num_threads; t++) {
+        failed += workers[t].failed;
+    }
+    struct vm_counters *b = &before.totals.counters, *a = &after.totals.counters;
+    unsigned long lock_wait = a->lock_wait_ns - b->lock_wait_ns;
+    unsigned long acquires = a->lock_acquires - b->lock_acquires;
+    unsigned long contended = a->lock_contended - b->lock_contended;
+
+    printf("%s\n    {\"threads\": %d, \"elapsed_ns\": %lu, \"ops_per_sec\": %.0f, \"failed_allocs\": %lu, ",
+        first ? "" : ",", num_threads, elapsed, num_threads * ops * 1e9 / elapsed, failed);
+    printf("\"lock\": {\"acquires\": %lu, \"contended\": %lu, \"wait_ns\": %lu, \"wait_fraction\": %.4f}, ",
+        acquires, contended, lock_wait, (double) lock_wait / ((double) elapsed * num_threads));
+    printf("\"latency\": {");
+    for(int op = 0; op < NUM_OPS; op++) {
+        print_latency(workers, num_threads, op);
+        printf(op < NUM_OPS - 1 ? ", " : "}}");
+    }
+    fflush(stdout);
+
+    for(int t = 0; t < num_threads; t++) {
+        for(int op = 0; op < NUM_OPS; op++) {
+            free(workers[t].latency[op]);
+        }
+    }
+    pthread_barrier_destroy(&ready);
+    pthread_barrier_destroy(&go);
+    free(workers);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-t threads] [-n ops] [-m read,write,alloc,free] [-s size|min-max] [-k keys] [-z skew] [-b bytes]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "t:n:m:s:k:z:b:")) != -1) {
+        if(opt == 't') {
+            max_threads = atoi(optarg);
+        }
+        else if(opt == 'n') {
+            ops = strtoul(optarg, NULL, 10);
+        }
+        else if(opt == 'm') {
+            if(sscanf(optarg, "%u,%u,%u,%u", &mix[0], &mix[1], &mix[2], &mix[3]) != 4
+                || mix[0] + mix[1] + mix[2] + mix[3] != 100) {
+                fprintf(stderr, "the mix is four percentages that add up to 100\n");
+                return 1;
+            }
+        }
+        else if(opt == 's') {
+            if(sscanf(optarg, "%u-%u", &min_size, &max_size) == 1) {
+                max_size = min_size;
+            }
+        }
+        else if(opt == 'k') {
+            num_keys = strtoul(optarg, NULL, 10);
+        }
+        else if(opt == 'z') {
+            skew = atof(optarg);
+        }
+        else if(opt == 'b') {
+            access_bytes = atoi(optarg);
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+    if(max_threads < 1 || ops < 1 || num_keys < 1 || min_size < 1 || min_size > max_size
+        || access_bytes < 1 || access_bytes > PGSIZE || skew < 0) {
+        usage(argv[0]);
+    }
+
+    set_physical_mem_size(PHYSICAL_MEM_SIZE, false);
+    keys = t_malloc(num_keys * PGSIZE);
+    if(!keys) {
+        fprintf(stderr, "could not allocate %lu keys\n", num_keys);
+        return 1;
+    }
+    init_keys();
+
+    printf("{\"config\": {\"max_threads\": %d, \"ops_per_thread\": %lu, \"mix\": {\"read\": %u, \"write\": %u, \"alloc\": %u, \"free\": %u}, ",
+        max_threads, ops, mix[0], mix[1], mix[2], mix[3]);
+    printf("\"min_size\": %u, \"max_size\": %u, \"keys\": %lu, \"skew\": %.2f, \"access_bytes\": %u},\n",
+        min_size, max_size, num_keys, skew, access_bytes);
+    printf(" \"results\": [");
+
+    for(int threads = 1; ; threads *= 2) {
+        if(threads > max_threads) {
+            threads = max_threads;
+        }
+        run(threads, threads == 1);
+        if(threads == max_threads) {
+            break;
+        }
+    }
+    printf("\n]}\n");
+
+    t_free(keys, num_keys * PGSIZE);
+    free(key_cdf);
+    return 0;
+}
@@ -11,22 +11,22 @@ int main() {
     printf("Allocating three arrays of %d bytes\n", ARRAY_SIZE);
 
     void *a = t_malloc(ARRAY_SIZE);
-    int old_a = (int)a;
+    unsigned long old_a = (unsigned long)a;
     void *b = t_malloc(ARRAY_SIZE);
     void *c = t_malloc(ARRAY_SIZE);
     int x = 1;
     int y, z;
     int i =0, j=0;
-    int address_a = 0, address_b = 0;
-    int address_c = 0;
+    unsigned long address_a = 0, address_b = 0;
+    unsigned long address_c = 0;
 
-    printf("Addresses of the allocations: %x, %x, %x\n", (int)a, (int)b, (int)c);
+    printf("Addresses of the allocations: %lx, %lx, %lx\n", (unsigned long)a, (unsigned long)b, (unsigned long)c);
 
     printf("Storing integers to generate a SIZExSIZE matrix\n");
     for (i = 0; i < SIZE; i++) {
         for (j = 0; j < SIZE; j++) {
-            address_a = (unsigned int)a + ((i * SIZE * sizeof(int))) + (j * sizeof(int));
-            address_b = (unsigned int)b + ((i * SIZE * sizeof(int))) + (j * sizeof(int));
+            address_a = (unsigned long)a + ((i * SIZE * sizeof(int))) + (j * sizeof(int));
+            address_b = (unsigned long)b + ((i * SIZE * sizeof(int))) + (j * sizeof(int));
             put_value((void *)address_a, &x, sizeof(int));
             put_value((void *)address_b, &x, sizeof(int));
         }
@@ -36,8 +36,8 @@ int main() {
 
     for (i = 0; i < SIZE; i++) {
         for (j = 0; j < SIZE; j++) {
-            address_a = (unsigned int)a + ((i * SIZE * sizeof(int))) + (j * sizeof(int));
-            address_b = (unsigned int)b + ((i * SIZE * sizeof(int))) + (j * sizeof(int));
+            address_a = (unsigned long)a + ((i * SIZE * sizeof(int))) + (j * sizeof(int));
+            address_b = (unsigned long)b + ((i * SIZE * sizeof(int))) + (j * sizeof(int));
             get_value((void *)address_a, &y, sizeof(int));
             get_value( (void *)address_b, &z, sizeof(int));
             printf("%d ", y);
@@ -51,7 +51,7 @@ int main() {
 
     for (i = 0; i < SIZE; i++) {
         for (j = 0; j < SIZE; j++) {
-            address_c = (unsigned int)c + ((i * SIZE * sizeof(int))) + (j * sizeof(int));
+            address_c = (unsigned long)c + ((i * SIZE * sizeof(int))) + (j * sizeof(int));
             get_value((void *)address_c, &y, sizeof(int));
             printf("%d ", y);
         }
@@ -64,7 +64,7 @@ int main() {
 
     printf("Checking if allocations were freed!\n");
     a = t_malloc(ARRAY_SIZE);
-    if ((int)a == old_a)
+    if ((unsigned long)a == old_a)
         printf("free function works\n");
     else
         printf("free function does not work\n");
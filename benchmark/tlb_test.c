@@ -0,0 +1,78 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "../my_vm.h"
+
+#define NUM_WAYS 4
+
+extern struct vm_context default_context;
+
+/*
+Touches page n of the allocation at a, which translates it through the TLB
+*/
+void touch(void *a, int n) {
+    int x = n;
+    put_value((char*) a + (unsigned long) n * PGSIZE, &x, sizeof(int));
+}
+
+/*
+With one fully associative set, fills every way with pages 0 to 3, uses page
+0 again and then misses on page 4. LRU has to evict page 1, the least recently
+used, while CLOCK finds every way referenced, clears them all and evicts the
+way under its hand, page 0. Returns the number of pages that were not where
+the policy should have left them.
+*/
+int check_policy(void *a, int policy, int evicted) {
+    int fails = 0;
+    struct tlb_info info;
+
+    set_tlb_config(NUM_WAYS, NUM_WAYS, policy);
+    for (int i = 0; i < NUM_WAYS; i++)
+        touch(a, i);
+    touch(a, 0);
+    touch(a, NUM_WAYS);
+
+    for (int i = 0; i <= NUM_WAYS; i++) {
+        void *va = (char*) a + (unsigned long) i * PGSIZE;
+        info.policy = -1;
+        bool hit = check_TLB(&default_context, va, &info) != NULL;
+        if (hit == (i == evicted)) {
+            printf("page %d is %s, expected it %s\n", i, hit ? "cached" : "not cached",
+                   i == evicted ? "evicted" : "cached");
+            fails++;
+        }
+        if (hit && (info.policy != policy || info.set != 0 || info.way >= NUM_WAYS)) {
+            printf("page %d hit reports policy %d, set %lu, way %u\n", i, info.policy, info.set, info.way);
+            fails++;
+        }
+    }
+    return fails;
+}
+
+int main() {
+
+    int fails = 0;
+
+    printf("Allocating %d pages\n", NUM_WAYS + 1);
+    void *a = t_malloc((NUM_WAYS + 1) * PGSIZE);
+
+    printf("Filling a %d-way LRU TLB, reusing the first page and missing once more\n", NUM_WAYS);
+    fails += check_policy(a, TLB_POLICY_LRU, 1);
+
+    printf("Doing the same with CLOCK\n");
+    fails += check_policy(a, TLB_POLICY_CLOCK, 0);
+
+    if (set_tlb_config(NUM_WAYS, 3, TLB_POLICY_LRU) == 0 || set_tlb_config(NUM_WAYS, NUM_WAYS, 2) == 0) {
+        printf("invalid geometry or policy accepted\n");
+        fails++;
+    }
+    set_tlb_config(TLB_ENTRIES, TLB_WAYS, TLB_POLICY_LRU);
+    t_free(a, (NUM_WAYS + 1) * PGSIZE);
+
+    if (fails == 0)
+        printf("TLB replacement works\n");
+    else
+        printf("TLB replacement does not work\n");
+
+    return fails != 0;
+}
@@ -1,13 +1,28 @@
 #include "my_vm.h"
 
 void* physical_mem;
-unsigned char* physical_bitmap;
-unsigned char* virtual_bitmap;
+bool vm_initialized = false;
+struct tlb tlb_store;
 
-pde_t* page_directory;
+//Size of the physical pool and whether to back it with transparent huge
+//pages, both fixed at the first t_malloc
+unsigned long physical_mem_size = MEMSIZE;
+bool physical_mem_hugepages = false;
+
+//Free blocks of this order and above are given back to the OS
+unsigned int release_order = RELEASE_ORDER;
+struct buddy physical_frames;
+struct frame_info* frame_table;
+
+//The address space used by the calls that take no context, and the list of
+//every context, guarded by lock. Asids are never reused, so a TLB entry of a
+//destroyed context can never match a new one.
+struct vm_context default_context = { .lock = PTHREAD_MUTEX_INITIALIZER };
+struct vm_context *vm_contexts;
+unsigned long next_asid = 0;
 
 unsigned int num_physical_pages;
-unsigned int num_virtual_pages;
+unsigned long num_virtual_pages;
 
 unsigned int num_vpn_bits;
 unsigned int num_offset_bits;
@@ -20,23 +35,94 @@ unsigned int max_pages_bits;
 unsigned int num_page_directory_bits;
 unsigned int num_page_table_bits;
 
-tlb tlb_arr[TLB_ENTRIES];
-unsigned long tlb_count = 0;
-unsigned long tlb_lookups = 0;
-unsigned long tlb_misses = 0;
+unsigned int tlb_num_entries = TLB_ENTRIES;
+unsigned int tlb_num_ways = TLB_WAYS;
+int tlb_policy = TLB_POLICY_LRU;
+unsigned int tlb_prefetch_depth = 0;
+
+//Bumped on every unmap; a thread whose TLB is older than this flushes it
+unsigned long tlb_generation = 0;
+
+//Every thread that has used the VM, plus the totals of threads that exited
+struct vm_thread *vm_threads;
+unsigned long tlb_retired_lookups = 0;
+unsigned long tlb_retired_misses = 0;
+unsigned long tlb_retired_evictions = 0;
+unsigned long tlb_retired_prefetches = 0;
+unsigned long tlb_retired_prefetch_hits = 0;
+struct vm_counters retired_stats;
+
+//Latency histograms need two clock reads per call, so they are opt in
+bool latency_stats = false;
+static __thread struct vm_thread *current_thread;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Guards setup, settings that apply to every context and the context list.
+//Taken before any context's lock, never while holding one.
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+//Guards the buddy allocator. Taken on its own by page faults inside read
+//sections, and only ever after a context's lock by everything else.
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Demand paging mode and the shared frame that reads of untouched pages see
+bool demand_paging = false;
+void* zero_page;
+
+//Swap file state. swap_lock guards the slot bitmap and the extra mappings of
+//each slot, swap_wait_lock and swap_cond wake the swap daemon when free frames
+//run low. evict_enabled is set once pages have somewhere to go, the swap file
+//or the compressed pool.
+bool evict_enabled = false;
+bool swap_daemon_started = false;
+bool swap_enabled = false;
+int swap_fd = -1;
+struct bitmap swap_slots;
+unsigned int *swap_shares;
+unsigned long swap_low_watermark;
+unsigned long swap_high_watermark;
+unsigned long swap_outs = 0;
+bool swap_wakeup = false;
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t swap_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t swap_cond = PTHREAD_COND_INITIALIZER;
+
+//Compressed pool state, guarded by zpool_lock. Each stored page takes a run
+//of chunks starting with a two byte header holding its compressed size, and
+//its extra mappings are counted at its first chunk.
+bool zpool_enabled = false;
+unsigned char *zpool;
+struct bitmap zpool_chunks;
+unsigned int *zpool_shares;
+unsigned long zpool_capacity;
+unsigned long zpool_pages = 0;
+unsigned long zpool_bytes = 0;
+unsigned long zpool_stores = 0;
+unsigned long zpool_rejects = 0;
+static pthread_mutex_t zpool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Frames freed by merge passes
+unsigned long pages_merged = 0;
+unsigned long zero_pages_merged = 0;
+
+//Frames mapped more than once, which eviction has to leave alone
+unsigned long shared_frames = 0;
+
 void init_bit_values() {
-    num_va_space_bits = 32;
-    num_pa_space_bits = num_bits_in_value(MEMSIZE);
+    num_va_space_bits = VM_VA_BITS;
+    num_pa_space_bits = num_bits_in_value(physical_mem_size);
     //max_bits = ((num_va_space_bits) < (num_pa_space_bits)) ? (num_va_space_bits) : (num_pa_space_bits); 
-    max_bits = 32;
+    max_bits = VM_VA_BITS;
     num_offset_bits = num_bits_in_value(PGSIZE);
     max_pages_bits = max_bits - num_offset_bits;
     num_vpn_bits = max_bits - num_offset_bits;
 
+    //Every level below the top indexes one page sized table, the top level
+    //(the page directory) takes whatever bits are left
     num_page_table_bits = num_bits_in_value(PGSIZE / sizeof(pte_t));
-    num_page_directory_bits = max_pages_bits - num_page_table_bits;
+    num_page_directory_bits = max_pages_bits - (VM_LEVELS - 1) * num_page_table_bits;
 
 }
 
@@ -50,10 +136,11 @@ void print_bit_values() {
     printf("Max pages bits: %d\n", max_pages_bits);
     printf("Page Table Bits: %d\n", num_page_table_bits);
     printf("Page Directory Bits: %d\n", num_page_directory_bits);
+    printf("Page Table Levels: %d\n", VM_LEVELS);
     printf("---------------------------\n");
 }
 
-unsigned int num_bits_in_value(unsigned int value) {
+unsigned int num_bits_in_value(unsigned long value) {
     int bits = 0;
     while(value >>= 1) {
         bits++;
@@ -61,44 +148,51 @@ unsigned int num_bits_in_value(unsigned int value) {
     return bits;
 }
 
-void init_page_tables() {
-    //Set page directory base
-    unsigned long nextFreePage = next_free_page(physical_bitmap);
-    set_bit(physical_bitmap, nextFreePage, 1);
-    page_directory = (pde_t*) (get_physical_addr_from_bit(nextFreePage));
-
-    //Allocate page tables and update bitmap
-    for(unsigned long i = 0; i < (1 << num_page_directory_bits); i++) {
-        nextFreePage = next_free_page(physical_bitmap);
-        set_bit(physical_bitmap, nextFreePage, 1);
+/*
+Sets up an empty address space in ctx and adds it to the context list. Lock
+must be held. Returns -1, leaving ctx empty, if there is no frame for its page
+directory or no memory for its bitmap.
+*/
+int init_context(struct vm_context *ctx) {
+    //Set page directory base, which needs more than one frame when a page
+    //table entry is wider than 32 bits
+    unsigned long num_directory_entries = 1UL << num_page_directory_bits;
+    unsigned long num_directory_frames = (num_directory_entries * sizeof(pde_t) + PGSIZE - 1) / PGSIZE;
+    ctx->page_directory = (pde_t*) alloc_frames(num_directory_frames);
+    if(!ctx->page_directory) {
+        return -1;
+    }
+    memset(ctx->page_directory, 0, num_directory_entries * sizeof(pde_t));
+    for(unsigned long i = 0; i < num_directory_frames; i++) {
+        get_frame_info((void*) ctx->page_directory + i * PGSIZE)->owner = ctx;
     }
 
-    //Set 0x0 as used in memory
-    set_bit(virtual_bitmap, 0, 1);
-}
+    //Page tables are allocated by walk_page_tables when their span is first
+    //mapped and freed by free_pages once it is empty again
 
-unsigned long next_free_page(unsigned char* bitmap) {
-    if(bitmap == physical_bitmap) {
-        for(int i = 0; i < num_physical_pages; i++) {
-            if(!get_bit(bitmap, i)) {
-                return i;
-            }
-        }
+    //Set 0x0 as used in memory
+    if(bitmap_init(&ctx->virtual_bitmap, num_virtual_pages) < 0) {
+        free_frames(ctx->page_directory, num_directory_frames);
+        ctx->page_directory = NULL;
+        return -1;
     }
-    else {
-        for(int i = 0; i < num_virtual_pages; i++) {
-            if(!get_bit(bitmap, i)) {
-                return i;
-            }
-        }
+    bitmap_set(&ctx->virtual_bitmap, 0, 1);
+
+    ctx->asid = next_asid++;
+    ctx->next = vm_contexts;
+    if(vm_contexts) {
+        vm_contexts->prev = ctx;
     }
-    
+    vm_contexts = ctx;
+    return 0;
 }
 
 /*
-Function responsible for allocating and setting your physical memory 
+Function responsible for allocating and setting your physical memory. Lock
+must be held. Returns -1, leaving physical_mem NULL, if the memory, the zero
+page or the default address space cannot be set up.
 */
-void set_physical_mem() {
+int set_physical_mem() {
 
     //Allocate physical memory using mmap or malloc; this is the total size of
     //your memory you are simulating
@@ -112,48 +206,383 @@ void set_physical_mem() {
         init_bit_values();
     }
 
-    //Create physical memory
-    physical_mem = malloc(MEMSIZE);
+    //Reserve physical memory without committing it, so the host only backs
+    //frames once they are touched. The mapping is page aligned, which leaves the
+    //low bits of a frame address free for page table entry flags.
+    unsigned long map_size = physical_mem_size;
+    if(physical_mem_hugepages) {
+        map_size += HUGEPAGE_SIZE;
+    }
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+    void* mem = map;
+
+    //Huge pages need a huge page aligned pool, so the spare head is skipped
+    if(physical_mem_hugepages) {
+        mem = (void*) (((unsigned long) mem + HUGEPAGE_SIZE - 1) & ~(unsigned long) (HUGEPAGE_SIZE - 1));
+        madvise(mem, physical_mem_size, MADV_HUGEPAGE);
+        release_order = HUGEPAGE_ORDER;
+    }
+    physical_mem = mem;
 
     //Calculate number of pages
-    num_physical_pages = MEMSIZE / PGSIZE;
-    num_virtual_pages = MAX_MEMSIZE / PGSIZE;
-
-    int virtual_bitmap_size = (num_virtual_pages + 7) / 8;
-    int physical_bitmap_size = (num_physical_pages + 7) / 8;
+    num_physical_pages = physical_mem_size / PGSIZE;
+    num_virtual_pages = 1UL << max_pages_bits;
 
-    virtual_bitmap = calloc(virtual_bitmap_size, sizeof(unsigned char));
-    physical_bitmap = calloc(physical_bitmap_size, sizeof(unsigned char));
+    if(buddy_init(&physical_frames, num_physical_pages) < 0) {
+        fprintf(stderr, "not enough host memory for the frame allocator\n");
+        munmap(map, map_size);
+        physical_mem = NULL;
+        return -1;
+    }
+    frame_table = calloc(num_physical_pages, sizeof(struct frame_info));
     //pthread_mutex_init(&lock, NULL);
 
-    //If page directory isn't set, set it
-    if(page_directory == NULL) {
-        init_page_tables();
+    //The zero page comes first, so a failure below has no context to unlink
+    zero_page = frame_table ? alloc_frames(1) : NULL;
+    if(!zero_page || (default_context.page_directory == NULL && init_context(&default_context) < 0)) {
+        fprintf(stderr, "not enough memory for the frame table, zero page and page directory\n");
+        free(frame_table);
+        buddy_destroy(&physical_frames);
+        munmap(map, map_size);
+        frame_table = NULL;
+        zero_page = NULL;
+        physical_mem = NULL;
+        return -1;
     }
-    
+    memset(zero_page, 0, PGSIZE);
+
+    set_swap_watermarks();
+
+    //Publish the setup last, get_value and put_value check it without the lock
+    __atomic_store_n(&vm_initialized, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/*
+Sets the size of physical memory in bytes and whether it is backed by
+transparent huge pages. Only takes effect before the first t_malloc. With
+huge pages, free memory is returned to the OS a whole huge page at a time.
+Returns 0 on success and -1 if memory is already set up or size is invalid.
+*/
+int set_physical_mem_size(unsigned long size, bool hugepages) {
+    if(size < 16 * PGSIZE || size > MAX_MEMSIZE || size % PGSIZE || size / PGSIZE >= BUDDY_NONE) {
+        return -1;
+    }
+    pthread_mutex_lock(&lock);
+    if(physical_mem) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    physical_mem_size = size;
+    physical_mem_hugepages = hugepages;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*
+Chooses the TLB geometry and replacement policy. Entries are split into
+entries / ways sets; ways == 1 gives a direct mapped TLB and ways == entries
+a fully associative one. Every thread's TLB is rebuilt, empty, with the new
+geometry before its next lookup.
+*/
+int set_tlb_config(unsigned int entries, unsigned int ways, int policy) {
+    if(entries == 0 || ways == 0 || entries % ways || (policy != TLB_POLICY_LRU && policy != TLB_POLICY_CLOCK)) {
+        return -1;
+    }
+    pthread_mutex_lock(&lock);
+    tlb_num_entries = entries;
+    tlb_num_ways = ways;
+    tlb_policy = policy;
+    tlb_shootdown(NULL);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*
+Turns the TLB prefetcher on with the given depth, or off with 0. On a miss,
+or on the first use of a prefetched entry, a thread that has seen the same
+page stride twice in a row fills the translations of the next depth pages of
+the stream into its TLB. Returns -1 if depth is above TLB_PREFETCH_MAX_DEPTH.
+*/
+int set_tlb_prefetch(unsigned int depth) {
+    if(depth > TLB_PREFETCH_MAX_DEPTH) {
+        return -1;
+    }
+    __atomic_store_n(&tlb_prefetch_depth, depth, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+Folds an exiting thread's counters into the retired totals and frees its TLB
+*/
+static void release_vm_thread(void *arg) {
+    struct vm_thread *thread = arg;
+
+    pthread_mutex_lock(&thread_lock);
+    tlb_retired_lookups += thread->tlb_lookups;
+    tlb_retired_misses += thread->tlb_misses;
+    tlb_retired_evictions += thread->tlb_evictions;
+    tlb_retired_prefetches += thread->tlb_prefetches;
+    tlb_retired_prefetch_hits += thread->tlb_prefetch_hits;
+    add_counters(&retired_stats, &thread->stats);
+    if(thread->prev) {
+        thread->prev->next = thread->next;
+    }
+    else {
+        vm_threads = thread->next;
+    }
+    if(thread->next) {
+        thread->next->prev = thread->prev;
+    }
+    pthread_mutex_unlock(&thread_lock);
+
+    free(thread->tlb_arr);
+    free(thread->tlb_clock_hands);
+    free(thread);
+    current_thread = NULL;
+}
+
+static void create_thread_key() {
+    pthread_key_create(&thread_key, release_vm_thread);
+}
+
+/*
+Returns the calling thread's state, creating and registering it on first use.
+Aborts with a message if the host cannot allocate it.
+*/
+struct vm_thread *get_vm_thread() {
+    if(current_thread) {
+        return current_thread;
+    }
+    pthread_once(&thread_key_once, create_thread_key);
+
+    //Every later call needs the state and most have no way to report an
+    //error, so there is nothing to fall back to
+    struct vm_thread *thread = calloc(1, sizeof(struct vm_thread));
+    if(!thread) {
+        fprintf(stderr, "not enough host memory for the state of a thread\n");
+        abort();
+    }
+    init_TLB(thread);
+
+    pthread_mutex_lock(&thread_lock);
+    thread->next = vm_threads;
+    if(vm_threads) {
+        vm_threads->prev = thread;
+    }
+    vm_threads = thread;
+    pthread_mutex_unlock(&thread_lock);
+
+    pthread_setspecific(thread_key, thread);
+    current_thread = thread;
+    return thread;
+}
+
+/*
+Allocates an empty TLB for a thread with the configured geometry, aborting
+if the host is out of memory
+*/
+void init_TLB(struct vm_thread *thread) {
+    free(thread->tlb_arr);
+    free(thread->tlb_clock_hands);
+    thread->tlb_generation = __atomic_load_n(&tlb_generation, __ATOMIC_ACQUIRE);
+    thread->tlb_num_entries = tlb_num_entries;
+    thread->tlb_num_ways = tlb_num_ways;
+    thread->tlb_num_sets = tlb_num_entries / tlb_num_ways;
+    thread->tlb_policy = tlb_policy;
+    thread->tlb_arr = calloc(thread->tlb_num_entries, sizeof(tlb));
+    thread->tlb_clock_hands = calloc(thread->tlb_num_sets, sizeof(unsigned int));
+    if(!thread->tlb_arr || !thread->tlb_clock_hands) {
+        fprintf(stderr, "not enough host memory for a TLB of %u entries\n", thread->tlb_num_entries);
+        abort();
+    }
+    memset(thread->super_tlb, 0, sizeof(thread->super_tlb));
+    thread->tlb_count = 0;
+}
+
+/*
+Invalidates every thread's TLB entries of ctx, or whole TLBs when ctx is NULL.
+Entries of ctx stop matching once its generation moves on, and each thread
+notices a new global generation on its next lookup and flushes its own TLB,
+so no other thread's TLB is written here.
+*/
+void tlb_shootdown(struct vm_context *ctx) {
+    if(ctx) {
+        __atomic_add_fetch(&ctx->tlb_generation, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    __atomic_add_fetch(&tlb_generation, 1, __ATOMIC_RELEASE);
+}
+
+/*
+Marks the start of a read section, during which the thread may walk page
+tables and touch frames without holding the lock. The counter is odd inside a
+section. The fence orders the store before any page table read, so a writer in
+synchronize_readers either sees the section or the section sees its unmap.
+Read sections never block on the lock.
+*/
+void enter_read_section(struct vm_thread *thread) {
+    __atomic_store_n(&thread->read_seq, thread->read_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void exit_read_section(struct vm_thread *thread) {
+    __atomic_store_n(&thread->read_seq, thread->read_seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+Waits until every read section that was running when this was called has
+ended. After unmapping pages and shooting down TLBs, this guarantees that no
+thread still uses a translation of the unmapped pages, so their frames can be
+reused.
+*/
+void synchronize_readers() {
+    struct vm_thread *self = current_thread;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&thread_lock);
+    for(struct vm_thread *thread = vm_threads; thread; thread = thread->next) {
+        unsigned long seq = __atomic_load_n(&thread->read_seq, __ATOMIC_ACQUIRE);
+        if(thread == self || !(seq & 1)) {
+            continue;
+        }
+        while(__atomic_load_n(&thread->read_seq, __ATOMIC_ACQUIRE) == seq) {
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&thread_lock);
+}
+
+/*
+Flushes the thread's TLB if a shootdown happened since it was last checked
+*/
+static void sync_TLB(struct vm_thread *thread) {
+    unsigned long generation = __atomic_load_n(&tlb_generation, __ATOMIC_ACQUIRE);
+    if(thread->tlb_generation == generation) {
+        return;
+    }
+    if(thread->tlb_num_entries != tlb_num_entries || thread->tlb_num_ways != tlb_num_ways || thread->tlb_policy != tlb_policy) {
+        init_TLB(thread);
+        return;
+    }
+    memset(thread->tlb_arr, 0, thread->tlb_num_entries * sizeof(tlb));
+    memset(thread->super_tlb, 0, sizeof(thread->super_tlb));
+    thread->tlb_count = 0;
+    thread->tlb_generation = generation;
 }
 
+/*
+Picks the way of a set to replace. Empty ways are used first, otherwise LRU
+takes the least recently used way and CLOCK sweeps the set's hand past
+referenced ways, clearing their bits, until it finds an unreferenced one.
+*/
+unsigned int get_tlb_victim(struct vm_thread *thread, unsigned long set) {
+    unsigned int ways = thread->tlb_num_ways;
+    unsigned int *hand = &thread->tlb_clock_hands[set];
+    tlb *entries = &thread->tlb_arr[set * ways];
+    for(unsigned int way = 0; way < ways; way++) {
+        if(!entries[way].valid) {
+            return way;
+        }
+    }
+
+    if(thread->tlb_policy == TLB_POLICY_CLOCK) {
+        while(entries[*hand].referenced) {
+            entries[*hand].referenced = 0;
+            *hand = (*hand + 1) % ways;
+        }
+        unsigned int victim = *hand;
+        *hand = (victim + 1) % ways;
+        return victim;
+    }
+
+    unsigned int victim = 0;
+    for(unsigned int way = 1; way < ways; way++) {
+        if(entries[way].last_used < entries[victim].last_used) {
+            victim = way;
+        }
+    }
+    return victim;
+}
 
 /*
  * Part 2: Add a virtual to physical page translation to the TLB.
  * Feel free to extend the function arguments or return type.
+ * The translation goes into the calling thread's TLB, tagged with the asid
+ * of ctx and the shootdown generation the translation was walked in. Reports
+ * the set and way filled, and whether a valid entry was evicted, through info
+ * when it is not NULL.
  */
 int
-add_TLB(void *va, void *pa)
+add_TLB(struct vm_context *ctx, void *va, void *pa, unsigned long generation, struct tlb_info *info)
 {
 
     /*Part 2 HINT: Add a virtual to physical page translation to the TLB */
-    unsigned long index = (unsigned long) get_tlb_index(va);
-    tlb_arr[index].va = va;
-    tlb_arr[index].pa = pa;
+    struct vm_thread *thread = get_vm_thread();
+    sync_TLB(thread);
+
+    unsigned long set = get_tlb_index(va);
+    unsigned int way = get_tlb_victim(thread, set);
+    tlb *entry = &thread->tlb_arr[set * thread->tlb_num_ways + way];
+    bool evicted = entry->valid;
+
+    if(evicted) {
+        thread->tlb_evictions++;
+    }
+    else {
+        thread->tlb_count++;
+    }
+    entry->va = va;
+    entry->pa = pa;
+    entry->asid = ctx->asid;
+    entry->generation = generation;
+    entry->valid = 1;
+    entry->referenced = 1;
+    entry->prefetched = 0;
+    entry->last_used = thread->tlb_lookups;
+
+    if(info) {
+        info->policy = thread->tlb_policy;
+        info->set = set;
+        info->way = way;
+        info->evicted = evicted;
+    }
     return 1;
 
 
     // return -1;
 }
+
+/*
+Caches the page table of the superpage containing va in the calling thread's
+superpage TLB, so every page of the superpage hits without a walk
+*/
+void add_super_TLB(struct vm_context *ctx, void *va, pte_t *page_table, unsigned long generation) {
+    struct vm_thread *thread = get_vm_thread();
+    sync_TLB(thread);
+
+    unsigned long super_vpn = (unsigned long) va >> (num_offset_bits + num_page_table_bits);
+    tlb *entry = &thread->super_tlb[super_vpn % SUPER_TLB_ENTRIES];
+    if(entry->valid) {
+        thread->tlb_evictions++;
+    }
+    entry->va = (void*) (super_vpn << (num_offset_bits + num_page_table_bits));
+    entry->pa = page_table;
+    entry->asid = ctx->asid;
+    entry->generation = generation;
+    entry->valid = 1;
+}
+
+/*
+Returns the set of the calling thread's TLB that a virtual address maps to
+*/
 unsigned long get_tlb_index(void *va){
     unsigned long vpn =  ((unsigned long) va) >> num_offset_bits;
-    unsigned long index = vpn % TLB_ENTRIES;
+    unsigned long index = vpn % get_vm_thread()->tlb_num_sets;
     return index;
 }
 
@@ -163,48 +592,331 @@ unsigned long get_tlb_index(void *va){
  * Part 2: Check TLB for a valid translation.
  * Returns the physical page address.
  * Feel free to extend this function and change the return type.
+ * Only the calling thread's TLB is consulted, and only entries of ctx from its
+ * current shootdown generation match. On a hit, info (when not NULL) reports
+ * the policy, set and way that hit.
  */
 pte_t *
-check_TLB(void *va) {
+check_TLB(struct vm_context *ctx, void *va, struct tlb_info *info) {
 
     /* Part 2: TLB lookup code here */
-    unsigned long index = get_tlb_index(va);
-    //printf("Check Index: %ld, va: %p, tlb_arr_va: %p\n", index, va, tlb_arr[index].va);
-    unsigned long va_vpn = ((unsigned long) va) >> num_offset_bits;
-    unsigned long tlb_vpn = ((unsigned long) tlb_arr[index].va) >> num_offset_bits;
-    if(va_vpn == tlb_vpn) {
-        return (pte_t*) tlb_arr[index].pa;
+    struct vm_thread *thread = get_vm_thread();
+    sync_TLB(thread);
+    unsigned long generation = __atomic_load_n(&ctx->tlb_generation, __ATOMIC_ACQUIRE);
+
+    //A superpage entry covers every page of its region
+    unsigned long super_vpn = (unsigned long) va >> (num_offset_bits + num_page_table_bits);
+    tlb *super_entry = &thread->super_tlb[super_vpn % SUPER_TLB_ENTRIES];
+    if(super_entry->valid && super_entry->asid == ctx->asid && super_entry->generation == generation
+        && (unsigned long) super_entry->va >> (num_offset_bits + num_page_table_bits) == super_vpn) {
+        if(info) {
+            info->policy = thread->tlb_policy;
+            info->set = super_vpn % SUPER_TLB_ENTRIES;
+            info->way = 0;
+            info->evicted = false;
+            info->prefetched = false;
+        }
+        unsigned long page_table_index = ((unsigned long) va >> num_offset_bits) & ((1UL << num_page_table_bits) - 1);
+        return (pte_t*) super_entry->pa + page_table_index;
     }
-    else {
+
+    tlb *entry = find_TLB_entry(thread, ctx, (unsigned long) va >> num_offset_bits, generation);
+    if(!entry) {
         return NULL;
     }
+    entry->referenced = 1;
+    entry->last_used = thread->tlb_lookups;
+    if(info) {
+        info->policy = thread->tlb_policy;
+        info->set = get_tlb_index(va);
+        info->way = entry - &thread->tlb_arr[info->set * thread->tlb_num_ways];
+        info->evicted = false;
+        info->prefetched = entry->prefetched;
+    }
+    entry->prefetched = 0;
+    return (pte_t*) entry->pa;
 
    /*This function should return a pte_t pointer*/
 }
 
+/*
+Returns the entry of the thread's TLB holding page vpn of ctx from the given
+shootdown generation, or NULL. Touches neither the entry nor the counters.
+*/
+tlb *find_TLB_entry(struct vm_thread *thread, struct vm_context *ctx, unsigned long vpn, unsigned long generation) {
+    tlb *entries = &thread->tlb_arr[(vpn % thread->tlb_num_sets) * thread->tlb_num_ways];
+    for(unsigned int way = 0; way < thread->tlb_num_ways; way++) {
+        unsigned long tlb_vpn = ((unsigned long) entries[way].va) >> num_offset_bits;
+        if(entries[way].valid && vpn == tlb_vpn && entries[way].asid == ctx->asid && entries[way].generation == generation) {
+            return &entries[way];
+        }
+    }
+    return NULL;
+}
+
+/*
+Trains the calling thread's stride detector on a lookup of va that missed or,
+when hit is set, first used a prefetched entry. Once the stride repeats, a
+miss fills the next depth pages of the stream that are allocated and not yet
+cached, and a hit slides that window one page further. Pages in superpages are
+left to the superpage TLB. Runs wherever translate does.
+*/
+void prefetch_TLB(struct vm_context *ctx, void *va, bool hit) {
+    unsigned int depth = __atomic_load_n(&tlb_prefetch_depth, __ATOMIC_RELAXED);
+    if(depth == 0) {
+        return;
+    }
+    struct vm_thread *thread = get_vm_thread();
+    unsigned long vpn = (unsigned long) va >> num_offset_bits;
+    long stride = vpn - thread->prefetch_vpn;
+    bool confirmed = thread->prefetch_asid == ctx->asid && stride != 0 && stride == thread->prefetch_stride;
+    if(thread->prefetch_asid != ctx->asid || stride != 0) {
+        thread->prefetch_asid = ctx->asid;
+        thread->prefetch_vpn = vpn;
+        thread->prefetch_stride = stride;
+    }
+    if(!confirmed) {
+        return;
+    }
+
+    unsigned long generation = __atomic_load_n(&ctx->tlb_generation, __ATOMIC_ACQUIRE);
+    for(unsigned int i = hit ? depth : 1; i <= depth; i++) {
+        unsigned long next = vpn + i * stride;
+        if(next >= num_virtual_pages) {
+            break;
+        }
+        if(find_TLB_entry(thread, ctx, next, generation)) {
+            continue;
+        }
+        if(!bitmap_get(&ctx->virtual_bitmap, next)) {
+            break;
+        }
+        pde_t *pde = NULL;
+        pte_t *pte = walk_page_tables(ctx->page_directory, (void*) (next << num_offset_bits), false, &pde);
+        if(!pte || (__atomic_load_n(pde, __ATOMIC_ACQUIRE) & PDE_LARGE)) {
+            break;
+        }
+
+        //A shootdown during the walk makes the entry stale on arrival, so it
+        //is never used
+        struct tlb_info info;
+        add_TLB(ctx, (void*) (next << num_offset_bits), pte, generation, &info);
+        thread->tlb_arr[info.set * thread->tlb_num_ways + info.way].prefetched = 1;
+        thread->tlb_prefetches++;
+    }
+}
+
 /*
  * Part 2: Print TLB miss rate.
  * Feel free to extend the function arguments or return type.
+ * Sums the counters of every live thread and of threads that have exited.
  */
 void
 print_TLB_missrate()
 {
     double miss_rate = 0;	
-    miss_rate = ((double) tlb_misses / (double) tlb_lookups) * 100;
+    struct vm_stats stats;
+    t_vm_stats(&stats);
 
     /*Part 2 Code here to calculate and print the TLB miss rate*/
+    if(stats.totals.tlb_lookups) {
+        miss_rate = ((double) stats.totals.tlb_misses / (double) stats.totals.tlb_lookups) * 100;
+    }
+
+
+    fprintf(stderr, "TLB miss rate %lf (%u entries, %u-way, %s, %lu evictions) \n", miss_rate,
+        tlb_num_entries, tlb_num_ways, tlb_policy == TLB_POLICY_CLOCK ? "CLOCK" : "LRU", stats.totals.tlb_evictions);
+    if(tlb_prefetch_depth) {
+        fprintf(stderr, "TLB prefetch depth %u: %lu prefetched, accuracy %lf, coverage %lf\n", tlb_prefetch_depth,
+            stats.totals.tlb_prefetches, stats.prefetch_accuracy, stats.prefetch_coverage);
+    }
+}
+
+void add_counters(struct vm_counters *total, struct vm_counters *counters) {
+    total->allocs += counters->allocs;
+    total->frees += counters->frees;
+    total->bytes_allocated += counters->bytes_allocated;
+    total->bytes_freed += counters->bytes_freed;
+    total->page_walks += counters->page_walks;
+    total->page_faults += counters->page_faults;
+    total->swap_ins += counters->swap_ins;
+    total->zpool_loads += counters->zpool_loads;
+    total->cow_faults += counters->cow_faults;
+    total->reallocs += counters->reallocs;
+    total->pages_remapped += counters->pages_remapped;
+    total->lock_acquires += counters->lock_acquires;
+    total->lock_contended += counters->lock_contended;
+    total->lock_wait_ns += counters->lock_wait_ns;
+    for(int op = 0; op < VM_NUM_OPS; op++) {
+        for(int bucket = 0; bucket < VM_LATENCY_BUCKETS; bucket++) {
+            total->latency[op][bucket] += counters->latency[op][bucket];
+        }
+    }
+}
+
+static void get_thread_stats(struct vm_thread *thread, struct vm_thread_stats *stats) {
+    stats->tlb_lookups = thread->tlb_lookups;
+    stats->tlb_misses = thread->tlb_misses;
+    stats->tlb_hits = stats->tlb_lookups - stats->tlb_misses;
+    stats->tlb_evictions = thread->tlb_evictions;
+    stats->tlb_prefetches = thread->tlb_prefetches;
+    stats->tlb_prefetch_hits = thread->tlb_prefetch_hits;
+    stats->counters = thread->stats;
+}
+
+/*
+Fills stats with a snapshot of the VM. Each thread's counters are read while
+that thread keeps running, so a snapshot taken under load is approximate.
+*/
+void t_vm_stats(struct vm_stats *stats) {
+    memset(stats, 0, sizeof(struct vm_stats));
+
+    pthread_mutex_lock(&thread_lock);
+    stats->totals.tlb_lookups = tlb_retired_lookups;
+    stats->totals.tlb_misses = tlb_retired_misses;
+    stats->totals.tlb_evictions = tlb_retired_evictions;
+    stats->totals.tlb_prefetches = tlb_retired_prefetches;
+    stats->totals.tlb_prefetch_hits = tlb_retired_prefetch_hits;
+    stats->totals.counters = retired_stats;
+    for(struct vm_thread *thread = vm_threads; thread; thread = thread->next) {
+        struct vm_thread_stats thread_stats;
+        get_thread_stats(thread, &thread_stats);
+        stats->totals.tlb_lookups += thread_stats.tlb_lookups;
+        stats->totals.tlb_misses += thread_stats.tlb_misses;
+        stats->totals.tlb_evictions += thread_stats.tlb_evictions;
+        stats->totals.tlb_prefetches += thread_stats.tlb_prefetches;
+        stats->totals.tlb_prefetch_hits += thread_stats.tlb_prefetch_hits;
+        add_counters(&stats->totals.counters, &thread_stats.counters);
+        stats->num_threads++;
+    }
+    pthread_mutex_unlock(&thread_lock);
+    stats->totals.tlb_hits = stats->totals.tlb_lookups - stats->totals.tlb_misses;
+    if(stats->totals.tlb_prefetches) {
+        stats->prefetch_accuracy = (double) stats->totals.tlb_prefetch_hits / stats->totals.tlb_prefetches;
+    }
+    if(stats->totals.tlb_prefetch_hits + stats->totals.tlb_misses) {
+        stats->prefetch_coverage = (double) stats->totals.tlb_prefetch_hits / (stats->totals.tlb_prefetch_hits + stats->totals.tlb_misses);
+    }
+    stats->swap_outs = __atomic_load_n(&swap_outs, __ATOMIC_RELAXED);
+    stats->zpool_stores = __atomic_load_n(&zpool_stores, __ATOMIC_RELAXED);
+    stats->zpool_rejects = __atomic_load_n(&zpool_rejects, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&zpool_lock);
+    stats->zpool_pages = zpool_pages;
+    stats->zpool_bytes = zpool_bytes;
+    pthread_mutex_unlock(&zpool_lock);
+    stats->zpool_capacity = zpool_capacity;
+    if(stats->zpool_bytes) {
+        stats->zpool_ratio = (double) stats->zpool_pages * PGSIZE / stats->zpool_bytes;
+    }
+    stats->pages_merged = __atomic_load_n(&pages_merged, __ATOMIC_RELAXED);
+    stats->zero_pages_merged = __atomic_load_n(&zero_pages_merged, __ATOMIC_RELAXED);
+
+    if(!__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    //The largest free block is the highest order with a free block
+    pthread_mutex_lock(&frame_lock);
+    stats->physical_free = physical_frames.free_count;
+    unsigned long max_order_frames = physical_frames.free_blocks[BUDDY_MAX_ORDER] << BUDDY_MAX_ORDER;
+    for(int order = BUDDY_MAX_ORDER; order >= 0; order--) {
+        if(physical_frames.free_blocks[order]) {
+            stats->largest_free_block = 1UL << order;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&frame_lock);
 
+    stats->physical_pages = num_physical_pages;
+    stats->physical_utilization = (double) (stats->physical_pages - stats->physical_free) / stats->physical_pages;
+    if(stats->physical_free) {
+        stats->fragmentation = 1 - (double) max_order_frames / stats->physical_free;
+    }
+
+    stats->virtual_pages = num_virtual_pages;
+    pthread_mutex_lock(&lock);
+    for(struct vm_context *ctx = vm_contexts; ctx; ctx = ctx->next) {
+        stats->virtual_used += __atomic_load_n(&ctx->virtual_bitmap.num_set, __ATOMIC_RELAXED);
+        stats->num_contexts++;
+    }
+    pthread_mutex_unlock(&lock);
+    stats->virtual_utilization = (double) stats->virtual_used / stats->virtual_pages;
+    stats->bytes_mapped = stats->virtual_used * PGSIZE;
+}
+
+/*
+Fills stats with a snapshot of up to max_threads live threads and returns how
+many were written
+*/
+int t_vm_thread_stats(struct vm_thread_stats *stats, int max_threads) {
+    int count = 0;
+    pthread_mutex_lock(&thread_lock);
+    for(struct vm_thread *thread = vm_threads; thread && count < max_threads; thread = thread->next) {
+        get_thread_stats(thread, &stats[count++]);
+    }
+    pthread_mutex_unlock(&thread_lock);
+    return count;
+}
+
+/*
+Turns the latency histograms of t_malloc, t_free, get_value and put_value on
+or off. They are off by default since timing costs two clock reads per call.
+*/
+void set_latency_stats(bool enabled) {
+    __atomic_store_n(&latency_stats, enabled, __ATOMIC_RELAXED);
+}
+
+static unsigned long get_time_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long) now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/*
+Returns the start time of a timed call, or 0 if latency stats are off
+*/
+unsigned long latency_start() {
+    if(!__atomic_load_n(&latency_stats, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return get_time_ns();
+}
+
+void record_latency(struct vm_thread *thread, int op, unsigned long start) {
+    if(!start) {
+        return;
+    }
+    unsigned long elapsed = get_time_ns() - start;
+    int bucket = elapsed ? 64 - __builtin_clzl(elapsed) : 0;
+    if(bucket >= VM_LATENCY_BUCKETS) {
+        bucket = VM_LATENCY_BUCKETS - 1;
+    }
+    thread->stats.latency[op][bucket]++;
+}
 
-    fprintf(stderr, "TLB miss rate %lf \n", miss_rate);
+/*
+Takes the lock of ctx. The uncontended case costs one trylock, only a thread
+that has to wait reads the clock to account for its wait.
+*/
+void lock_vm(struct vm_context *ctx) {
+    struct vm_thread *thread = get_vm_thread();
+    thread->stats.lock_acquires++;
+    if(pthread_mutex_trylock(&ctx->lock) == 0) {
+        return;
+    }
+    thread->stats.lock_contended++;
+    unsigned long start = get_time_ns();
+    pthread_mutex_lock(&ctx->lock);
+    thread->stats.lock_wait_ns += get_time_ns() - start;
 }
 
 
 
 /*
-The function takes a virtual address and page directories starting address and
-performs translation to return the physical address
+The function takes a context and a virtual address and performs translation,
+starting at the context's page directory, to return the physical address
 */
-pte_t *translate(pde_t *pgdir, void *va) {
+pte_t *translate(struct vm_context *ctx, void *va) {
     /* Part 1 HINT: Get the Page directory index (1st level) Then get the
     * 2nd-level-page table index using the virtual address.  Using the page
     * directory index and page table index get the physical address.
@@ -212,44 +924,114 @@ pte_t *translate(pde_t *pgdir, void *va) {
     * Part 2 HINT: Check the TLB before performing the translation. If
     * translation exists, then you can return physical address from the TLB.
     */ 
-    pte_t *tlb_result = check_TLB(va);
-    tlb_lookups++;
+    struct vm_thread *thread = get_vm_thread();
+    struct tlb_info info;
+    thread->tlb_lookups++;
+    pte_t *tlb_result = check_TLB(ctx, va, &info);
     //hit
     if(tlb_result != NULL){
+        //A prefetch that paid off keeps the stream going
+        if(info.prefetched) {
+            thread->tlb_prefetch_hits++;
+            prefetch_TLB(ctx, va, true);
+        }
         return tlb_result;
     }
 
-    tlb_misses++;
-    unsigned long vpn = ((unsigned long) va) >> num_offset_bits;
-    unsigned long offset = ((unsigned long) va) & ((1 << num_offset_bits) - 1);
-
-    //Get page directory and page table indecies
-    unsigned long page_table_index = vpn & ((1 << num_page_table_bits) - 1);
-    unsigned long page_directory_index = (vpn >> num_page_table_bits) & ((1 << num_page_directory_bits) - 1);
-    
-    //Get page directory entry
-    pde_t* pde = pgdir + page_directory_index;
+    thread->tlb_misses++;
+    unsigned long generation = __atomic_load_n(&ctx->tlb_generation, __ATOMIC_ACQUIRE);
+    pde_t* pde = NULL;
+    pte_t* pte = walk_page_tables(ctx->page_directory, va, false, &pde);
+    if(!pte) {
+        return NULL;
+    }
 
-    //Get page table entry
-    pte_t* pte = pde + page_table_index;
+    //A shootdown during the walk may have unlinked a table it went through.
+    //The result stays valid for the current read section but is not cached,
+    //since the table can be freed once the section ends.
+    if(__atomic_load_n(&ctx->tlb_generation, __ATOMIC_ACQUIRE) != generation) {
+        return pte;
+    }
 
-    //assuming pte is physical addr **CHECK THIS
-    add_TLB(va,pte);
+    //A large entry in the lowest directory level covers the whole page table
+    //below it with one superpage TLB entry
+    if(__atomic_load_n(pde, __ATOMIC_ACQUIRE) & PDE_LARGE) {
+        add_super_TLB(ctx, va, pte - (((unsigned long) va >> num_offset_bits) & ((1UL << num_page_table_bits) - 1)), generation);
+    }
+    else {
+        add_TLB(ctx, va, pte, generation, NULL);
+        prefetch_TLB(ctx, va, false);
+    }
+    return pte;
 
+}
 
-    return pte;
 
+/*
+Walks the page tables from pgdir down to the page table entry of va, one level
+of num_page_table_bits at a time below the page directory. A missing table is
+allocated when alloc is set, which needs the lock of the context owning
+pgdir, and belongs to that context; otherwise NULL is returned. Walks without
+the lock are safe inside a read section, since free_pages only frees unlinked
+tables after a grace period. pde, when not NULL, is set to the entry of the
+lowest directory level, the one that can map a superpage.
+*/
+pte_t *walk_page_tables(pde_t *pgdir, void *va, bool alloc, pde_t **pde) {
+    get_vm_thread()->stats.page_walks++;
+    unsigned long vpn = (unsigned long) va >> num_offset_bits;
+    pde_t *table = pgdir;
+    for(int level = VM_LEVELS - 1; level > 0; level--) {
+        unsigned long index = (vpn >> (level * num_page_table_bits));
+        if(level < VM_LEVELS - 1) {
+            index &= (1UL << num_page_table_bits) - 1;
+        }
+        pde_t *entry_ptr = table + index;
+        pde_t entry = __atomic_load_n(entry_ptr, __ATOMIC_ACQUIRE);
+        if(!entry) {
+            if(!alloc) {
+                return NULL;
+            }
+            entry = (pde_t) alloc_page_table(get_frame_info(table)->owner);
+            if(!entry) {
+                return NULL;
+            }
+            __atomic_store_n(entry_ptr, entry, __ATOMIC_RELEASE);
+        }
+        if(pde) {
+            *pde = entry_ptr;
+        }
+        table = (pde_t*) (entry & ~PTE_FLAGS);
+    }
+    return (pte_t*) table + (vpn & ((1UL << num_page_table_bits) - 1));
 }
 
+/*
+Allocates a zeroed frame for a page table of ctx, swapping pages of ctx out if
+memory is full. The lock of ctx must be held. Returns NULL if no frame can be
+found.
+*/
+void *alloc_page_table(struct vm_context *ctx) {
+    void *table = alloc_frames(1);
+    while(!table && evict_frames(ctx, SWAP_BATCH) > 0) {
+        table = alloc_frames(1);
+    }
+    if(table) {
+        memset(table, 0, PGSIZE);
+        get_frame_info(table)->owner = ctx;
+    }
+    return table;
+}
 
 /*
-The function takes a page directory address, virtual address, physical address
-as an argument, and sets a page table entry. This function will walk the page
+The function takes a context, virtual address, physical address as an
+argument, and sets a page table entry. This function will walk the page
 directory to see if there is an existing mapping for a virtual address. If the
-virtual address is not present, then a new entry will be added
+virtual address is not present, then a new entry will be added. Returns 1 if
+the page was mapped, 0 if it already was and -1 if a page table could not be
+allocated.
 */
 int
-page_map(pde_t *pgdir, void *va, void *pa)
+page_map(struct vm_context *ctx, void *va, void *pa)
 {
 
     /*HINT: Similar to translate(), find the page directory (1st level)
@@ -258,323 +1040,3335 @@ page_map(pde_t *pgdir, void *va, void *pa)
 
     unsigned long bit_index = (((unsigned long) va) >> num_offset_bits);
     //Check if address is mapped in bitmap
-    if(get_bit(virtual_bitmap, bit_index)) {
+    if(bitmap_get(&ctx->virtual_bitmap, bit_index)) {
         return 0;
     }
 
-    set_bit(virtual_bitmap, bit_index, 1);
-    pte_t* pte = translate(page_directory, va);
-    *pte = (pte_t) pa;
+    //Intermediate tables are created as needed, which fails if memory is full
+    pte_t* pte = walk_page_tables(ctx->page_directory, va, true, NULL);
+    if(!pte) {
+        return -1;
+    }
+    bitmap_set(&ctx->virtual_bitmap, bit_index, 1);
+    get_frame_info(pa)->pte = pte;
+    __atomic_store_n(pte, (pte_t) pa, __ATOMIC_RELEASE);
     return 1;
 
 }
 
 
-/*Function that gets the next available page
+/*
+Maps the superpage starting at va, which is superpage aligned and unmapped, to
+the contiguous frames starting at pa. The page table entries are filled in as
+well, marked PTE_LARGE so the swap clock leaves them alone, and the directory
+entry is marked large last. Lock must be held. Returns -1 if a page table
+could not be allocated.
 */
-void *get_next_avail(int num_pages) {
- 
-    //Use virtual address bitmap to find the next free page
-    unsigned long start_page = 0;
-    unsigned int num_free_pages = 0;
-    for(int i = 0; i < num_virtual_pages; i++) {
-        if(!get_bit(virtual_bitmap, i)) {
-            if(num_free_pages == 0) {
-                start_page = i;
-            }
-            num_free_pages++;
-            if(num_free_pages == num_pages) {
-                return (void*) (start_page << num_offset_bits);
-            }
-        }
-        else {
-            num_free_pages = 0;
+int map_superpage(struct vm_context *ctx, void *va, void *pa) {
+    unsigned long vpn = (unsigned long) va >> num_offset_bits;
+    unsigned long num_pages = 1UL << num_page_table_bits;
+    pde_t *pde;
+    pte_t *page_table = walk_page_tables(ctx->page_directory, va, true, &pde);
+    if(!page_table) {
+        return -1;
+    }
+
+    for(unsigned long i = 0; i < num_pages; i++) {
+        void *frame = pa + i * PGSIZE;
+        bitmap_set(&ctx->virtual_bitmap, vpn + i, 1);
+        get_frame_info(frame)->pte = &page_table[i];
+        __atomic_store_n(&page_table[i], (pte_t) frame | PTE_LARGE, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(pde, (pde_t) page_table | PDE_LARGE, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+Splits a superpage back into single pages before part or all of it is
+unmapped. Its page table is already filled in, so only the large bits are
+cleared. Superpage TLB entries left behind still resolve to the same page
+table, so they stay correct until the next shootdown. Lock must be held.
+*/
+void demote_superpage(struct vm_context *ctx, void *va) {
+    pde_t *pde;
+    if(!walk_page_tables(ctx->page_directory, va, false, &pde)) {
+        return;
+    }
+    pde_t pde_entry = *pde;
+    if(!(pde_entry & PDE_LARGE)) {
+        return;
+    }
+    pte_t *page_table = (pte_t*) (pde_entry & ~PTE_FLAGS);
+    __atomic_store_n(pde, (pde_t) page_table, __ATOMIC_RELEASE);
+    for(unsigned long i = 0; i < (1UL << num_page_table_bits); i++) {
+        __atomic_fetch_and(&page_table[i], ~(pte_t) PTE_LARGE, __ATOMIC_ACQ_REL);
+    }
+}
+
+/*Function that gets the next available page
+*/
+void *get_next_avail(struct vm_context *ctx, int num_pages) {
+ 
+    //Use virtual address bitmap to find the next free run of pages
+    unsigned long start_page = bitmap_find_free_run(&ctx->virtual_bitmap, num_pages);
+    if(start_page == BITMAP_NONE) {
+        return NULL;
+    }
+    return (void*) (start_page << num_offset_bits);
+}
+
+/*
+Like get_next_avail, but the run starts on a multiple of align pages, which
+must be a power of two
+*/
+void *get_next_avail_aligned(struct vm_context *ctx, int num_pages, unsigned long align) {
+    unsigned long start_page = bitmap_find_aligned_run(&ctx->virtual_bitmap, num_pages, align);
+    if(start_page == BITMAP_NONE) {
+        return NULL;
+    }
+    return (void*) (start_page << num_offset_bits);
+}
+
+
+/*
+Returns the slab covering the page that va lives in, or NULL if the page
+belongs to a page-granular allocation
+*/
+struct slab *find_slab(struct vm_context *ctx, void *va) {
+    unsigned long vpn = (unsigned long) va >> num_offset_bits;
+    struct slab *slab = ctx->slab_hash[vpn % SLAB_HASH_SIZE];
+    while(slab) {
+        if(((unsigned long) slab->va >> num_offset_bits) == vpn) {
+            return slab;
+        }
+        slab = slab->hash_next;
+    }
+    return NULL;
+}
+
+/*
+Returns the size class that an allocation of num_bytes is served from
+*/
+int get_slab_class(unsigned int num_bytes) {
+    int slab_class = 0;
+    unsigned int class_size = SLAB_MIN_SIZE;
+    while(class_size < num_bytes) {
+        class_size <<= 1;
+        slab_class++;
+    }
+    return slab_class;
+}
+
+void slab_list_remove(struct vm_context *ctx, struct slab *slab) {
+    if(slab->prev) {
+        slab->prev->next = slab->next;
+    }
+    else {
+        ctx->slab_partial[slab->slab_class] = slab->next;
+    }
+    if(slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+void slab_list_push(struct vm_context *ctx, struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = ctx->slab_partial[slab->slab_class];
+    if(slab->next) {
+        slab->next->prev = slab;
+    }
+    ctx->slab_partial[slab->slab_class] = slab;
+}
+
+/*
+Carves a small object out of a slab page of the matching size class. A new
+slab page is mapped when every slab of the class is full. Lock must be held.
+*/
+void *slab_alloc(struct vm_context *ctx, unsigned int num_bytes) {
+    int slab_class = get_slab_class(num_bytes);
+    struct slab *slab = ctx->slab_partial[slab_class];
+
+    //No slab with free objects, so map a fresh page for one
+    if(!slab) {
+        void* va = alloc_pages(ctx, 1);
+        if(!va) {
+            return NULL;
+        }
+        slab = calloc(1, sizeof(struct slab));
+        slab->va = va;
+        slab->slab_class = slab_class;
+        slab->obj_size = SLAB_MIN_SIZE << slab_class;
+        slab->num_objs = PGSIZE / slab->obj_size;
+        slab->num_free = slab->num_objs;
+
+        unsigned long vpn = (unsigned long) va >> num_offset_bits;
+        slab->hash_next = ctx->slab_hash[vpn % SLAB_HASH_SIZE];
+        ctx->slab_hash[vpn % SLAB_HASH_SIZE] = slab;
+        slab_list_push(ctx, slab);
+    }
+
+    //Take the first free object in the slab
+    unsigned int obj = 0;
+    while(get_bit(slab->used, obj)) {
+        obj++;
+    }
+    set_bit(slab->used, obj, 1);
+    slab->num_free--;
+
+    //Full slabs leave the partial list until an object is freed
+    if(slab->num_free == 0) {
+        slab_list_remove(ctx, slab);
+    }
+    return (void*) ((unsigned long) slab->va + obj * slab->obj_size);
+}
+
+/*
+Returns an object to its slab. The slab page is unmapped once every object in
+it has been freed. Lock must be held.
+*/
+void slab_free(struct vm_context *ctx, struct slab *slab, void *va) {
+    unsigned long offset = (unsigned long) va - (unsigned long) slab->va;
+    unsigned int obj = offset / slab->obj_size;
+
+    //Only free objects that start on an object boundary and are in use
+    if(offset % slab->obj_size || !get_bit(slab->used, obj)) {
+        return;
+    }
+    set_bit(slab->used, obj, 0);
+    slab->num_free++;
+
+    if(slab->num_free == 1) {
+        slab_list_push(ctx, slab);
+    }
+    if(slab->num_free < slab->num_objs) {
+        return;
+    }
+
+    //Slab is empty, so unlink it and give its page back
+    slab_list_remove(ctx, slab);
+    unsigned long vpn = (unsigned long) slab->va >> num_offset_bits;
+    struct slab **link = &ctx->slab_hash[vpn % SLAB_HASH_SIZE];
+    while(*link != slab) {
+        link = &(*link)->hash_next;
+    }
+    *link = slab->hash_next;
+    free_pages(ctx, slab->va, 1);
+    free(slab);
+}
+
+/*
+Maps num_pages contiguous virtual pages to free physical pages.
+Lock must be held.
+*/
+void *alloc_pages(struct vm_context *ctx, unsigned int num_pages) {
+    void *va = find_free_pages(ctx, num_pages);
+    if(!va || map_pages(ctx, va, num_pages, demand_paging) < 0) {
+        return NULL;
+    }
+    return va;
+}
+
+/*
+Returns where num_pages free contiguous virtual pages of ctx start, or NULL.
+Lock must be held.
+*/
+void *find_free_pages(struct vm_context *ctx, unsigned int num_pages) {
+    //Requests of at least a superpage start on a superpage boundary, so their
+    //whole superpages can be mapped large
+    unsigned long super_pages = 1UL << num_page_table_bits;
+    void* va = NULL;
+    if(!demand_paging && num_pages >= super_pages) {
+        va = get_next_avail_aligned(ctx, num_pages, super_pages);
+    }
+    //Check if there are available pages
+    if(!va) {
+        va = get_next_avail(ctx, num_pages);
+    }
+    return va;
+}
+
+/*
+Allocates the num_pages free virtual pages at va in ctx and backs them with
+frames. With reserve_only only their page tables are created, and frames
+come from handle_page_fault on the first write. Lock must be held. Returns 0
+on success and -1, leaving nothing allocated, if memory runs out.
+*/
+int map_pages(struct vm_context *ctx, void *va, unsigned int num_pages, bool reserve_only) {
+    unsigned long super_pages = 1UL << num_page_table_bits;
+
+    //Faults run without the lock, so the page tables of reserved pages are
+    //created now
+    if(reserve_only) {
+        unsigned long vpn = (unsigned long) va >> num_offset_bits;
+        for (unsigned int i = 0; i < num_pages; i++) {
+            if(!walk_page_tables(ctx->page_directory, va + (unsigned long) i * PGSIZE, true, NULL)) {
+                free_pages(ctx, va, i);
+                return -1;
+            }
+            bitmap_set(&ctx->virtual_bitmap, vpn + i, 1);
+        }
+        return 0;
+    }
+
+    //Back the pages with contiguous runs of frames, falling back to smaller
+    //runs when physical memory is too fragmented for one run
+    unsigned int num_mapped = 0;
+    unsigned int run_pages = 1 << BUDDY_MAX_ORDER;
+    while(num_mapped < num_pages) {
+        void* page_va = va + (unsigned long) num_mapped * PGSIZE;
+        if(num_pages - num_mapped >= super_pages && !(((unsigned long) page_va >> num_offset_bits) & (super_pages - 1))) {
+            void* pa = alloc_frames(super_pages);
+            if(pa && map_superpage(ctx, page_va, pa) == 0) {
+                num_mapped += super_pages;
+                continue;
+            }
+            if(pa) {
+                free_frames(pa, super_pages);
+            }
+        }
+
+        if(run_pages > num_pages - num_mapped) {
+            run_pages = num_pages - num_mapped;
+        }
+        void* pa = alloc_frames(run_pages);
+        if(!pa) {
+            if(run_pages > 1) {
+                run_pages /= 2;
+                continue;
+            }
+            //Out of frames, so swap some out unless there is nothing left to evict
+            if(evict_frames(ctx, SWAP_BATCH) > 0) {
+                continue;
+            }
+            free_pages(ctx, va, num_mapped);
+            return -1;
+        }
+        for (unsigned int i = 0; i < run_pages; i++) {
+            if(page_map(ctx, page_va + (unsigned long) i * PGSIZE, pa + (unsigned long) i * PGSIZE) < 0) {
+                free_frames(pa + (unsigned long) i * PGSIZE, run_pages - i);
+                free_pages(ctx, va, num_mapped + i);
+                return -1;
+            }
+        }
+        num_mapped += run_pages;
+    }
+    return 0;
+}
+
+/*
+Moves the num_pages allocated pages at old_va of ctx to new_va, which must
+already be reserved with empty entries, by handing over their page table
+entries, and frees the old pages. Frames, swap slots and shares go with the
+entries. Lock must be held.
+*/
+void remap_pages(struct vm_context *ctx, void *old_va, void *new_va, unsigned int num_pages) {
+    unsigned long first_span = ((unsigned long) old_va >> num_offset_bits) >> num_page_table_bits;
+    unsigned long last_span = (((unsigned long) old_va >> num_offset_bits) + num_pages - 1) >> num_page_table_bits;
+    for(unsigned long i = first_span; i <= last_span; i++) {
+        demote_superpage(ctx, (void*) (i << (num_page_table_bits + num_offset_bits)));
+    }
+
+    for(unsigned int i = 0; i < num_pages; i++) {
+        pte_t *old_pte = walk_page_tables(ctx->page_directory, old_va + (unsigned long) i * PGSIZE, false, NULL);
+        pte_t *new_pte = walk_page_tables(ctx->page_directory, new_va + (unsigned long) i * PGSIZE, false, NULL);
+        pte_t entry = __atomic_exchange_n(old_pte, 0, __ATOMIC_ACQ_REL);
+        void *pa = pte_frame(entry);
+        if(pa && pa != zero_page && get_frame_info(pa)->pte == old_pte) {
+            get_frame_info(pa)->pte = new_pte;
+        }
+        __atomic_store_n(new_pte, entry, __ATOMIC_RELEASE);
+    }
+
+    //The emptied old pages are unmapped like any other, which also waits out
+    //readers still using them
+    free_pages(ctx, old_va, num_pages);
+}
+
+/*
+Unmaps num_pages virtual pages starting at va and releases their physical pages.
+Lock must be held and the range must already be validated.
+*/
+void free_pages(struct vm_context *ctx, void *va, unsigned int num_pages) {
+    if(num_pages == 0) {
+        return;
+    }
+    unsigned long first_vpn = (unsigned long) va >> num_offset_bits;
+    unsigned long last_vpn = first_vpn + num_pages - 1;
+    unsigned long num_spans = (last_vpn >> num_page_table_bits) - (first_vpn >> num_page_table_bits) + 1;
+    pte_t* entries = malloc(num_pages * sizeof(pte_t));
+    pte_t** ptes = malloc(num_pages * sizeof(pte_t*));
+    void** tables = malloc(num_spans * (VM_LEVELS - 1) * sizeof(void*));
+    if(entries && ptes && tables) {
+        unmap_pages(ctx, first_vpn, num_pages, entries, ptes, tables);
+    }
+
+    //Without host memory for the whole range, it is unmapped one page table
+    //at a time, each paying for its own grace period
+    else {
+        pte_t span_entries[PGSIZE / sizeof(pte_t)];
+        pte_t* span_ptes[PGSIZE / sizeof(pte_t)];
+        void* span_tables[VM_LEVELS - 1];
+        for(unsigned long vpn = first_vpn; vpn <= last_vpn;) {
+            unsigned long span_end = ((vpn >> num_page_table_bits) + 1) << num_page_table_bits;
+            unsigned int count = (span_end <= last_vpn ? span_end : last_vpn + 1) - vpn;
+            unmap_pages(ctx, vpn, count, span_entries, span_ptes, span_tables);
+            vpn += count;
+        }
+    }
+    free(tables);
+    free(ptes);
+    free(entries);
+}
+
+/*
+Does the work of free_pages for the num_pages pages from first_vpn on. The
+caller provides room for an entry and a page table entry pointer per page and
+for VM_LEVELS - 1 page tables per page table span the range touches.
+*/
+void unmap_pages(struct vm_context *ctx, unsigned long first_vpn, unsigned int num_pages, pte_t *entries, pte_t **ptes,
+                 void **tables) {
+    //Superpages the range touches are split into single pages first
+    unsigned long last_vpn = first_vpn + num_pages - 1;
+    unsigned long first_span = first_vpn >> num_page_table_bits;
+    unsigned long last_span = last_vpn >> num_page_table_bits;
+    for(unsigned long i = first_span; i <= last_span; i++) {
+        demote_superpage(ctx, (void*) (i << (num_page_table_bits + num_offset_bits)));
+    }
+
+    //Release the virtual pages first so no new reader can fault them back in.
+    //They cannot be handed out again before this returns since the lock is held.
+    for (unsigned int i = 0; i < num_pages; i++) {
+        bitmap_set(&ctx->virtual_bitmap, first_vpn + i, 0);
+    }
+
+    //Clear the page table entries so no new translation can find them. The
+    //tables are walked directly, once per page table, so the unmap does not
+    //fill the TLB or feed the prefetcher with pages that are going away.
+    for (unsigned int i = 0; i < num_pages; i++) {
+        unsigned long vpn = first_vpn + i;
+        if(i == 0 || (vpn & ((1UL << num_page_table_bits) - 1)) == 0) {
+            ptes[i] = walk_page_tables(ctx->page_directory, (void*) (vpn << num_offset_bits), false, NULL);
+        }
+        else {
+            ptes[i] = ptes[i - 1] + 1;
+        }
+        entries[i] = __atomic_exchange_n(ptes[i], 0, __ATOMIC_ACQ_REL);
+    }
+
+    //Page tables left with no mapped page are unlinked now and freed once
+    //no reader can still be walking them
+    int num_tables = 0;
+    for(unsigned long i = first_span; i <= last_span; i++) {
+        num_tables = unlink_empty_tables(ctx, (void*) (i << (num_page_table_bits + num_offset_bits)), tables, num_tables);
+    }
+
+    //Stale translations of the unmapped pages must not be used by any thread,
+    //and readers that already hold one have to finish before frames are reused
+    tlb_shootdown(ctx);
+    synchronize_readers();
+
+    //A reader that started before the unmap may have faulted a page in since
+    for (unsigned int i = 0; i < num_pages; i++) {
+        pte_t late_entry = __atomic_exchange_n(ptes[i], 0, __ATOMIC_ACQ_REL);
+        if(late_entry) {
+            release_entry(entries[i]);
+            entries[i] = late_entry;
+        }
+    }
+
+    //Physically contiguous frames are handed back to the buddy allocator as one run
+    void* run_start = NULL;
+    unsigned int run_pages = 0;
+    for (unsigned int i = 0; i < num_pages; i++) {
+        void* pa = (void*) (entries[i] & ~PTE_FLAGS);
+
+        //Untouched and swapped out pages have no frame to coalesce, and pinned
+        //or shared frames are kept
+        if(!entries[i] || (entries[i] & PTE_SWAPPED) || pa == zero_page || get_frame_info(pa)->pin_count
+            || __atomic_load_n(&get_frame_info(pa)->shares, __ATOMIC_ACQUIRE)) {
+            release_entry(entries[i]);
+            continue;
+        }
+        get_frame_info(pa)->pte = NULL;
+
+        if(run_pages && pa == run_start + (unsigned long) run_pages * PGSIZE) {
+            run_pages++;
+        }
+        else {
+            if(run_pages) {
+                free_frames(run_start, run_pages);
+            }
+            run_start = pa;
+            run_pages = 1;
+        }
+    }
+    if(run_pages) {
+        free_frames(run_start, run_pages);
+    }
+
+    for (int i = 0; i < num_tables; i++) {
+        free_frames(tables[i], 1);
+    }
+}
+
+/*
+Unlinks the page table covering the span that starts at va if none of its
+pages is mapped any more, then each table above it that this leaves empty,
+stopping below the page directory. The unlinked tables are appended to
+tables, and the new count is returned. Readers may still walk them until the
+next grace period, so the caller frees them after synchronize_readers.
+Lock must be held.
+*/
+int unlink_empty_tables(struct vm_context *ctx, void *va, void **tables, int num_tables) {
+    unsigned long vpn = (unsigned long) va >> num_offset_bits;
+    pde_t *path[VM_LEVELS];
+    pde_t *table = ctx->page_directory;
+    for(int level = VM_LEVELS - 1; level > 0; level--) {
+        unsigned long index = vpn >> (level * num_page_table_bits);
+        if(level < VM_LEVELS - 1) {
+            index &= (1UL << num_page_table_bits) - 1;
+        }
+        path[level] = table + index;
+        pde_t entry = *path[level];
+        if(!entry || (entry & PDE_LARGE)) {
+            return num_tables;
+        }
+        table = (pde_t*) (entry & ~PTE_FLAGS);
+    }
+
+    //A page table is empty when no page of its span is mapped, a directory
+    //table when all its entries are clear
+    if(!bitmap_range_clear(&ctx->virtual_bitmap, vpn, 1UL << num_page_table_bits)) {
+        return num_tables;
+    }
+    for(int level = 1; level < VM_LEVELS; level++) {
+        if(level > 1) {
+            pde_t *child = (pde_t*) (*path[level] & ~PTE_FLAGS);
+            for(unsigned long i = 0; i < (1UL << num_page_table_bits); i++) {
+                if(child[i]) {
+                    return num_tables;
+                }
+            }
+        }
+        tables[num_tables++] = (void*) (*path[level] & ~PTE_FLAGS);
+        __atomic_store_n(path[level], 0, __ATOMIC_RELEASE);
+    }
+    return num_tables;
+}
+
+/*
+Releases whatever an unmapped page table entry held: its swap slot or pool
+chunks if it was evicted, or its frame, which is kept until the last unpin if
+it is pinned and by its other mappings if it is shared
+*/
+void release_entry(pte_t entry) {
+    if(!entry) {
+        return;
+    }
+    if(entry & PTE_SWAPPED) {
+        free_stored_page(entry);
+        return;
+    }
+
+    void* pa = (void*) (entry & ~PTE_FLAGS);
+    if(pa == zero_page) {
+        return;
+    }
+    struct frame_info *frame = get_frame_info(pa);
+    frame->pte = NULL;
+    if(drop_share(frame)) {
+        return;
+    }
+    if(frame->pin_count) {
+        frame->flags |= FRAME_FREE_DEFERRED;
+        return;
+    }
+    free_frames(pa, 1);
+}
+
+/*
+Checks that every page touched by the size bytes starting at va is allocated
+in the virtual bitmap of ctx
+*/
+bool range_is_mapped(struct vm_context *ctx, void *va, unsigned long size) {
+    if(size == 0) {
+        return true;
+    }
+    unsigned long first_vpn = (unsigned long) va >> num_offset_bits;
+    unsigned long last_vpn = ((unsigned long) va + size - 1) >> num_offset_bits;
+    if(last_vpn >= num_virtual_pages || last_vpn < first_vpn) {
+        return false;
+    }
+    for (unsigned long vpn = first_vpn; vpn <= last_vpn; vpn++) {
+        if(!bitmap_get(&ctx->virtual_bitmap, vpn)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* Function responsible for allocating pages
+and used by the benchmark
+*/
+void *t_malloc(unsigned int num_bytes) {
+
+    /* 
+     * HINT: If the physical memory is not yet initialized, then allocate and initialize.
+     */
+
+   /* 
+    * HINT: If the page directory is not initialized, then initialize the
+    * page directory. Next, using get_next_avail(), check if there are free pages. If
+    * free pages are available, set the bitmaps and map a new page. Note, you will 
+    * have to mark which physical pages are used. 
+    */
+
+    return t_vm_malloc(&default_context, num_bytes);
+}
+
+/*
+Allocates num_bytes in the address space of ctx. Returns NULL if num_bytes is
+0 or there is no room, after swapping out pages of other contexts if swap is on.
+*/
+void *t_vm_malloc(struct vm_context *ctx, unsigned int num_bytes) {
+    struct vm_thread *thread = get_vm_thread();
+    unsigned long start = latency_start();
+
+    //Initialize physical memory is it hasn't been
+    if(!__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&lock);
+        if(!physical_mem) {
+            set_physical_mem();
+        }
+        pthread_mutex_unlock(&lock);
+        if(!physical_mem) {
+            return NULL;
+        }
+    }
+
+    if(num_bytes == 0) {
+        return NULL;
+    }
+
+    //Small requests share slab pages, larger ones get whole pages. Allocation
+    //only evicts pages of ctx, so when that is not enough the other contexts
+    //are asked for frames too.
+    void* va;
+    do {
+        lock_vm(ctx);
+        if(num_bytes <= SLAB_MAX_SIZE) {
+            va = slab_alloc(ctx, num_bytes);
+        }
+        else {
+            unsigned int num_pages = (num_bytes + PGSIZE - 1) / PGSIZE;
+            va = alloc_pages(ctx, num_pages);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    } while(!va && evict_enabled && reclaim_frames(SWAP_BATCH) > 0);
+
+    if(va) {
+        thread->stats.allocs++;
+        thread->stats.bytes_allocated += num_bytes;
+    }
+    record_latency(thread, VM_OP_MALLOC, start);
+    return va;
+}
+
+/* Responsible for releasing one or more memory pages using virtual address (va)
+*/
+void t_free(void *va, int size) {
+
+    /* Part 1: Free the page table entries starting from this virtual address
+     * (va). Also mark the pages free in the bitmap. Perform free only if the 
+     * memory from "va" to va+size is valid.
+     *
+     * Part 2: Also, remove the translation from the TLB
+     */
+
+    t_vm_free(&default_context, va, size);
+}
+
+/*
+Frees the size bytes at va in the address space of ctx, if they are allocated
+*/
+void t_vm_free(struct vm_context *ctx, void *va, int size) {
+    struct vm_thread *thread = get_vm_thread();
+    unsigned long start = latency_start();
+    if(!__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE) || size <= 0) {
+        return;
+    }
+    lock_vm(ctx);
+
+    //Objects inside a slab page go back to their slab
+    struct slab *slab = find_slab(ctx, va);
+    if(slab) {
+        slab_free(ctx, slab, va);
+        pthread_mutex_unlock(&ctx->lock);
+        thread->stats.frees++;
+        thread->stats.bytes_freed += size;
+        record_latency(thread, VM_OP_FREE, start);
+        return;
+    }
+
+    //Number of pages to free
+    unsigned int num_pages = (size + PGSIZE - 1) / PGSIZE;
+
+    //Check if num_pages pages are allocated in the virtual bitmap
+    if(((unsigned long) va & (PGSIZE - 1)) || !range_is_mapped(ctx, va, (unsigned long) num_pages * PGSIZE)) {
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
+
+    free_pages(ctx, va, num_pages);
+    pthread_mutex_unlock(&ctx->lock);
+    thread->stats.frees++;
+    thread->stats.bytes_freed += size;
+    record_latency(thread, VM_OP_FREE, start);
+}
+
+/*
+Resizes the old_size byte allocation at va to new_size bytes and returns where
+it now lives, keeping its first bytes. A NULL va allocates and a new_size of 0
+frees. Page allocations grow in place when the pages after them are free and
+otherwise move by handing their page table entries to the new pages, so no
+byte is copied. Small objects in slab pages are copied frame to frame.
+Returns NULL, leaving the allocation as it was, if memory runs out or va is
+not allocated.
+*/
+void *t_realloc(void *va, unsigned int old_size, unsigned int new_size) {
+    return t_vm_realloc(&default_context, va, old_size, new_size);
+}
+
+/*
+t_realloc in the address space of ctx
+*/
+void *t_vm_realloc(struct vm_context *ctx, void *va, unsigned int old_size, unsigned int new_size) {
+    if(!va) {
+        return t_vm_malloc(ctx, new_size);
+    }
+    if(new_size == 0) {
+        t_vm_free(ctx, va, old_size);
+        return NULL;
+    }
+    if(!__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE) || old_size == 0) {
+        return NULL;
+    }
+    struct vm_thread *thread = get_vm_thread();
+    unsigned long start = latency_start();
+    lock_vm(ctx);
+
+    //A slab object keeps its place while the new size fits its size class,
+    //anything else is copied to a new allocation, whose bytes the t_malloc
+    //and t_free it is made of already count
+    struct slab *slab = find_slab(ctx, va);
+    if(slab) {
+        unsigned int obj_size = slab->obj_size;
+        pthread_mutex_unlock(&ctx->lock);
+        void *moved = va;
+        if(new_size <= obj_size) {
+            if(new_size > old_size) {
+                thread->stats.bytes_allocated += new_size - old_size;
+            }
+            else {
+                thread->stats.bytes_freed += old_size - new_size;
+            }
+        }
+        else {
+            moved = t_vm_malloc(ctx, new_size);
+            if(moved) {
+                t_vm_memcpy(ctx, moved, va, old_size < new_size ? old_size : new_size);
+                t_vm_free(ctx, va, old_size);
+            }
+        }
+        if(moved) {
+            thread->stats.reallocs++;
+        }
+        record_latency(thread, VM_OP_REALLOC, start);
+        return moved;
+    }
+
+    unsigned int old_pages = (old_size + PGSIZE - 1) / PGSIZE;
+    unsigned int new_pages = (new_size + PGSIZE - 1) / PGSIZE;
+    unsigned long vpn = (unsigned long) va >> num_offset_bits;
+    if(((unsigned long) va & (PGSIZE - 1)) || !range_is_mapped(ctx, va, (unsigned long) old_pages * PGSIZE)) {
+        pthread_mutex_unlock(&ctx->lock);
+        return NULL;
+    }
+
+    void *moved = va;
+    if(new_pages < old_pages) {
+        free_pages(ctx, va + (unsigned long) new_pages * PGSIZE, old_pages - new_pages);
+    }
+    else if(new_pages > old_pages) {
+        //Grow in place if the pages right after the allocation are free
+        unsigned int extra_pages = new_pages - old_pages;
+        void *extra_va = va + (unsigned long) old_pages * PGSIZE;
+        if(vpn + new_pages <= num_virtual_pages && bitmap_range_clear(&ctx->virtual_bitmap, vpn + old_pages, extra_pages)) {
+            if(map_pages(ctx, extra_va, extra_pages, demand_paging) < 0) {
+                moved = NULL;
+            }
+        }
+        //Otherwise the old pages are reserved anew somewhere with room and
+        //their entries moved there, and only the extra pages get new frames
+        else {
+            moved = find_free_pages(ctx, new_pages);
+            if(moved && map_pages(ctx, moved, old_pages, true) < 0) {
+                moved = NULL;
+            }
+            if(moved && map_pages(ctx, moved + (unsigned long) old_pages * PGSIZE, extra_pages, demand_paging) < 0) {
+                free_pages(ctx, moved, old_pages);
+                moved = NULL;
+            }
+            if(moved) {
+                remap_pages(ctx, va, moved, old_pages);
+                thread->stats.pages_remapped += old_pages;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    if(moved) {
+        thread->stats.reallocs++;
+        if(new_size > old_size) {
+            thread->stats.bytes_allocated += new_size - old_size;
+        }
+        else {
+            thread->stats.bytes_freed += old_size - new_size;
+        }
+    }
+    record_latency(thread, VM_OP_REALLOC, start);
+    return moved;
+}
+
+
+/* The function copies data pointed by "val" to physical
+ * memory pages using virtual address (va)
+ * The function returns 0 if the put is successfull and -1 otherwise.
+*/
+int put_value(void *va, void *val, int size) {
+
+    /* HINT: Using the virtual address and translate(), find the physical page. Copy
+     * the contents of "val" to a physical page. NOTE: The "size" value can be larger 
+     * than one page. Therefore, you may have to find multiple pages using translate()
+     * function.
+     */
+    
+    return t_vm_put_value(&default_context, va, val, size);
+
+    /*return -1 if put_value failed and 0 if put is successfull*/
+
+}
+
+
+/*Given a virtual address, this function copies the contents of the page to val*/
+void get_value(void *va, void *val, int size) {
+
+    /* HINT: put the values pointed to by "va" inside the physical memory at given
+    * "val" address. Assume you can access "val" directly by derefencing them.
+    */
+
+    t_vm_get_value(&default_context, va, val, size);
+
+}
+
+/*
+put_value and get_value on the address space of ctx. Both return 0 on success
+and -1 if part of the range is not mapped.
+*/
+int t_vm_put_value(struct vm_context *ctx, void *va, void *val, int size) {
+    if(size < 0) {
+        return -1;
+    }
+    return copy_value(ctx, va, val, size, true);
+}
+
+int t_vm_get_value(struct vm_context *ctx, void *va, void *val, int size) {
+    if(size < 0) {
+        return -1;
+    }
+    return copy_value(ctx, va, val, size, false);
+}
+
+/*
+Copies size bytes between val and the virtual range starting at va in ctx, in
+the direction given by write. Runs inside a read section instead of taking
+the lock, so calls on mapped pages proceed in parallel with each other and
+with t_malloc; t_free waits for the section to end before reusing any frame.
+Returns 0 on success and -1 if part of the range is not mapped, in which
+case nothing is copied. A failed write can still have stored the bytes
+before some page of the range when a t_free racing the copy unmaps that page
+after the range was checked, or when that page needs a frame or a private
+copy that no retry can find, or cannot be read back from swap.
+*/
+int copy_value(struct vm_context *ctx, void *va, void *val, unsigned long size, bool write) {
+    struct vm_thread *thread = get_vm_thread();
+    struct page_cache cache = { .vpn = BITMAP_NONE };
+    unsigned long start = latency_start();
+    int ret = -1;
+
+    enter_read_section(thread);
+    if(__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE)) {
+        ret = copy_range(ctx, &cache, va, val, size, write);
+        while(ret <= VM_NO_MEMORY && resolve_in_read_section(ctx, thread, &cache, ret)) {
+            ret = copy_range(ctx, &cache, va, val, size, write);
+        }
+    }
+    exit_read_section(thread);
+    record_latency(thread, write ? VM_OP_PUT : VM_OP_GET, start);
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+Called inside a read section when a fault found no free frame or a write hit
+a shared page. Leaves the section, since eviction waits for readers and
+copying takes the lock of ctx, swaps frames out or copies the shared pages,
+and enters a new section. Returns true if the copy should be retried, and
+false at once for a page that could not be read back, which no amount of
+reclaiming fixes.
+*/
+bool resolve_in_read_section(struct vm_context *ctx, struct vm_thread *thread, struct page_cache *cache, int error) {
+    bool resolved;
+    if(error == VM_IO_ERROR) {
+        return false;
+    }
+    exit_read_section(thread);
+    if(error == VM_COPY_ON_WRITE) {
+        resolved = copy_on_write(ctx, cache->cow_va, cache->cow_size) == 0;
+        cache->cow_va = NULL;
+    }
+    //Other threads or the swap daemon may have freed frames meanwhile and
+    //left nothing to evict, which is just as good
+    else {
+        resolved = reclaim_frames(SWAP_BATCH) > 0 || __atomic_load_n(&physical_frames.free_count, __ATOMIC_RELAXED) > 0;
+    }
+    enter_read_section(thread);
+    cache->vpn = BITMAP_NONE;
+    return resolved;
+}
+
+/*
+Gives the page behind pte, whose virtual address in ctx is va, a frame of its
+own if it is shared with a snapshot or another context. The last sharer just
+takes the frame over. A page in a superpage is split out of it first. Lock of
+ctx must be held. Returns 0 on success and VM_NO_MEMORY if no frame could be
+found for the copy.
+*/
+int break_cow(struct vm_context *ctx, pte_t *pte, void *va) {
+    while(true) {
+        pte_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+        if(!(entry & PTE_COW)) {
+            return 0;
+        }
+        if(entry & PTE_LARGE) {
+            demote_superpage(ctx, va);
+            continue;
+        }
+
+        //The zero page belongs to no one, so a page still backed by it always
+        //gets a fresh frame
+        void *pa = (void*) (entry & ~PTE_FLAGS);
+        struct frame_info *frame = get_frame_info(pa);
+        if(pa != zero_page && __atomic_load_n(&frame->shares, __ATOMIC_ACQUIRE) == 0) {
+            if(__atomic_compare_exchange_n(pte, &entry, entry & ~(pte_t) PTE_COW, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                frame->pte = pte;
+                return 0;
+            }
+            continue;
+        }
+
+        void *copy = copy_frame(ctx, pa);
+        if(!copy) {
+            return VM_NO_MEMORY;
+        }
+        if(!__atomic_compare_exchange_n(pte, &entry, (pte_t) copy, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free_frames(copy, 1);
+            continue;
+        }
+        get_frame_info(copy)->pte = pte;
+        get_vm_thread()->stats.cow_faults++;
+        if(pa == zero_page) {
+            return 0;
+        }
+        if(frame->pte == pte) {
+            frame->pte = NULL;
+        }
+
+        //Another context may have dropped its share meanwhile, in which case
+        //this was the last mapping and the frame is freed once no reader of
+        //the old entry is left
+        if(!drop_share(frame)) {
+            synchronize_readers();
+            free_frames(pa, 1);
+        }
+        return 0;
+    }
+}
+
+/*
+Gives a frame one more mapping
+*/
+void add_share(struct frame_info *frame) {
+    if(__atomic_fetch_add(&frame->shares, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_fetch_add(&shared_frames, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+Drops one share of a frame mapped more than once. Returns false, dropping
+nothing, if the caller holds the last mapping.
+*/
+bool drop_share(struct frame_info *frame) {
+    unsigned int shares = __atomic_load_n(&frame->shares, __ATOMIC_ACQUIRE);
+    while(shares > 0) {
+        if(__atomic_compare_exchange_n(&frame->shares, &shares, shares - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if(shares == 1) {
+                __atomic_fetch_sub(&shared_frames, 1, __ATOMIC_RELAXED);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+Returns a new frame holding a copy of the frame at pa, swapping pages of ctx
+out if memory is full. Lock of ctx must be held. Returns NULL if no frame can
+be found.
+*/
+void *copy_frame(struct vm_context *ctx, void *pa) {
+    void *copy = alloc_frames(1);
+    while(!copy && evict_frames(ctx, SWAP_BATCH) > 0) {
+        copy = alloc_frames(1);
+    }
+    if(copy) {
+        memcpy(copy, pa, PGSIZE);
+    }
+    return copy;
+}
+
+/*
+Copies every shared page in the size bytes starting at va in ctx, taking the
+lock once for all of them. Returns 0 on success and -1 if memory ran out.
+*/
+int copy_on_write(struct vm_context *ctx, void *va, unsigned long size) {
+    unsigned long first_vpn = (unsigned long) va >> num_offset_bits;
+    unsigned long last_vpn = ((unsigned long) va + size - 1) >> num_offset_bits;
+    int ret = 0;
+
+    lock_vm(ctx);
+    for(unsigned long vpn = first_vpn; vpn <= last_vpn && ret == 0; vpn++) {
+        void *page_va = (void*) (vpn << num_offset_bits);
+        if(!bitmap_get(&ctx->virtual_bitmap, vpn)) {
+            continue;
+        }
+        pte_t *pte = translate(ctx, page_va);
+        if(pte && (__atomic_load_n(pte, __ATOMIC_ACQUIRE) & PTE_COW)) {
+            ret = break_cow(ctx, pte, page_va);
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+Returns the frame backing the page of va in ctx, reusing the cached
+translation when va is on the same page as the last one looked up. Must be
+called inside a read section. Returns NULL if the page is not mapped, or
+could not be faulted in, in which case cache->error says why.
+*/
+void *get_cached_page(struct vm_context *ctx, struct page_cache *cache, void *va, bool write) {
+    unsigned long vpn = (unsigned long) va >> num_offset_bits;
+    if(vpn == cache->vpn && (!write || cache->page != zero_page)) {
+        return cache->page;
+    }
+    if(vpn >= num_virtual_pages || !bitmap_get(&ctx->virtual_bitmap, vpn)) {
+        cache->error = -1;
+        return NULL;
+    }
+
+    //Get physical page number, which t_free may have just cleared
+    pte_t *pte = translate(ctx, va);
+    if(!pte) {
+        cache->error = -1;
+        return NULL;
+    }
+    pte_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+    void *page = pte_frame(entry);
+
+    //A page shared with a snapshot is copied before it is written, which
+    //needs the lock
+    if(page && write && (entry & PTE_COW)) {
+        cache->cow_va = va;
+        return NULL;
+    }
+
+    //A reserved page that was never written reads as zeros and is backed on
+    //its first write; swapped out pages are read back in
+    if(!page) {
+        page = (!entry && !write) ? zero_page : handle_page_fault(pte, &cache->error);
+    }
+    //Mark the page recently used for the swap clock, writing only when the bit
+    //is clear so hot pages cause no repeated shared writes
+    else if(evict_enabled && !(entry & PTE_ACCESSED)) {
+        __atomic_fetch_or(pte, PTE_ACCESSED, __ATOMIC_RELAXED);
+    }
+    if(page) {
+        cache->vpn = vpn;
+        cache->page = page;
+    }
+    return page;
+}
+
+/*
+Makes the page behind pte present and returns its frame. Runs inside a read
+section, so it never takes the lock. A page never written under demand paging
+gets a zero filled frame, a page being swapped out has its eviction cancelled,
+and a swapped out page is read back from its slot. If another thread resolves
+the same fault first, its frame is used. Returns NULL if no frame is free or
+the page cannot be read back, leaving the page swapped out, and sets error to
+VM_NO_MEMORY or VM_IO_ERROR.
+*/
+void *handle_page_fault(pte_t *pte, int *error) {
+    struct vm_thread *thread = get_vm_thread();
+    while(true) {
+        pte_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+        void *frame = pte_frame(entry);
+        if(frame) {
+            return frame;
+        }
+
+        //The swap daemon has not written the page out yet, so keep it. The
+        //daemon notices the entry changed and drops its copy.
+        if(entry & PTE_SWAPPING) {
+            pte_t present = entry & ~PTE_SWAPPING;
+            if(__atomic_compare_exchange_n(pte, &entry, present, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return pte_frame(present);
+            }
+            continue;
+        }
+
+        frame = alloc_frames(1);
+        if(!frame) {
+            *error = VM_NO_MEMORY;
+            return NULL;
+        }
+        if(entry & PTE_SWAPPED) {
+            if(load_page(entry, frame) < 0) {
+                free_frames(frame, 1);
+                //A copy that no longer decodes was replaced under us
+                if(__atomic_load_n(pte, __ATOMIC_ACQUIRE) != entry) {
+                    continue;
+                }
+                *error = VM_IO_ERROR;
+                return NULL;
+            }
+        }
+        else {
+            memset(frame, 0, PGSIZE);
+        }
+
+        if(!__atomic_compare_exchange_n(pte, &entry, (pte_t) frame, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free_frames(frame, 1);
+            continue;
+        }
+        get_frame_info(frame)->pte = pte;
+        if(entry & PTE_SWAPPED) {
+            free_stored_page(entry);
+            if(!(entry & PTE_COMPRESSED)) {
+                thread->stats.swap_ins++;
+            }
+        }
+        else {
+            thread->stats.page_faults++;
+        }
+        return frame;
+    }
+}
+
+/*
+Returns the frame a page table entry maps, or NULL if the page is not present
+*/
+void *pte_frame(pte_t entry) {
+    if(!entry || (entry & PTE_NOT_PRESENT)) {
+        return NULL;
+    }
+    return (void*) (entry & ~PTE_FLAGS);
+}
+
+/*
+Turns demand paging on or off for later t_malloc calls. When on, t_malloc only
+reserves virtual pages; each page gets a frame on its first write and reads of
+pages never written return zeros from a shared zero page.
+*/
+void set_demand_paging(bool enabled) {
+    pthread_mutex_lock(&lock);
+    demand_paging = enabled;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+Enables swapping to the file at path, which is created or truncated and can
+hold size bytes of pages. Once enabled, a background daemon swaps out cold
+pages, chosen by CLOCK over the accessed bits, whenever free frames fall below
+a low watermark, and faults bring them back on their next access.
+Returns 0 on success and -1 if the file cannot be opened.
+*/
+int set_swap_file(const char *path, unsigned long size) {
+    unsigned long num_slots = size / PGSIZE;
+    if(num_slots == 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    if(swap_enabled || bitmap_init(&swap_slots, num_slots) < 0) {
+        pthread_mutex_unlock(&lock);
+        close(fd);
+        return -1;
+    }
+    swap_shares = calloc(num_slots, sizeof(unsigned int));
+    if(!swap_shares) {
+        bitmap_destroy(&swap_slots);
+        pthread_mutex_unlock(&lock);
+        close(fd);
+        return -1;
+    }
+    swap_fd = fd;
+    swap_enabled = true;
+    start_swap_daemon();
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*
+Keeps cold pages compressed in a pool of size bytes of host memory instead of
+failing or going to disk. Eviction tries the pool first and falls back to
+the swap file for pages that do not compress or do not fit. A fault on a
+compressed page decompresses it into a new frame and frees its chunks.
+Returns 0 on success and -1 if the pool is already set up or cannot be mapped.
+*/
+int set_compressed_tier(unsigned long size) {
+    unsigned long num_chunks = size / ZPOOL_CHUNK;
+    if(num_chunks < PGSIZE / ZPOOL_CHUNK) {
+        return -1;
+    }
+    void *pool = mmap(NULL, num_chunks * ZPOOL_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(pool == MAP_FAILED) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    if(zpool_enabled || bitmap_init(&zpool_chunks, num_chunks) < 0) {
+        pthread_mutex_unlock(&lock);
+        munmap(pool, num_chunks * ZPOOL_CHUNK);
+        return -1;
+    }
+    zpool_shares = calloc(num_chunks, sizeof(unsigned int));
+    if(!zpool_shares) {
+        bitmap_destroy(&zpool_chunks);
+        pthread_mutex_unlock(&lock);
+        munmap(pool, num_chunks * ZPOOL_CHUNK);
+        return -1;
+    }
+    zpool = pool;
+    zpool_capacity = num_chunks * ZPOOL_CHUNK;
+    __atomic_store_n(&zpool_enabled, true, __ATOMIC_RELEASE);
+    start_swap_daemon();
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*
+Turns eviction on and starts the swap daemon the first time a place to evict
+to is set up. Lock must be held.
+*/
+void start_swap_daemon() {
+    set_swap_watermarks();
+    __atomic_store_n(&evict_enabled, true, __ATOMIC_RELEASE);
+    if(swap_daemon_started) {
+        return;
+    }
+    swap_daemon_started = true;
+    pthread_t daemon;
+    pthread_create(&daemon, NULL, swap_daemon, NULL);
+    pthread_detach(daemon);
+}
+
+/*
+The daemon starts evicting below the low watermark and stops at the high one
+*/
+void set_swap_watermarks() {
+    swap_low_watermark = num_physical_pages / 64;
+    swap_high_watermark = num_physical_pages / 32;
+}
+
+/*
+Reads and writes one page of the swap file. Return 0, or -1 if the whole page
+could not be transferred.
+*/
+int read_swap_slot(unsigned long slot, void *frame) {
+    return pread(swap_fd, frame, PGSIZE, (off_t) slot * PGSIZE) == PGSIZE ? 0 : -1;
+}
+
+int write_swap_slot(unsigned long slot, void *frame) {
+    return pwrite(swap_fd, frame, PGSIZE, (off_t) slot * PGSIZE) == PGSIZE ? 0 : -1;
+}
+
+unsigned long alloc_swap_slot() {
+    pthread_mutex_lock(&swap_lock);
+    unsigned long slot = bitmap_find_free_run(&swap_slots, 1);
+    if(slot != BITMAP_NONE) {
+        bitmap_set(&swap_slots, slot, 1);
+    }
+    pthread_mutex_unlock(&swap_lock);
+    return slot;
+}
+
+void free_swap_slot(unsigned long slot) {
+    pthread_mutex_lock(&swap_lock);
+    bitmap_set(&swap_slots, slot, 0);
+    pthread_mutex_unlock(&swap_lock);
+}
+
+/*
+Saves a copy of the page in frame, compressed in the pool when it is small
+enough and there is room, otherwise in a swap slot. Returns the page table
+entry that refers to the copy, or 0 if there is nowhere to put it or the
+swap file cannot be written, in which case the page stays in frame.
+*/
+pte_t store_page(void *frame) {
+    if(__atomic_load_n(&zpool_enabled, __ATOMIC_ACQUIRE)) {
+        unsigned char buffer[ZPOOL_MAX_SIZE];
+        unsigned int size = lz_compress(frame, PGSIZE, buffer, ZPOOL_MAX_SIZE);
+        if(size == 0) {
+            __atomic_fetch_add(&zpool_rejects, 1, __ATOMIC_RELAXED);
+        }
+        else {
+            unsigned long num_chunks = (size + 2 + ZPOOL_CHUNK - 1) / ZPOOL_CHUNK;
+            pthread_mutex_lock(&zpool_lock);
+            unsigned long chunk = bitmap_find_free_run(&zpool_chunks, num_chunks);
+            if(chunk != BITMAP_NONE) {
+                for(unsigned long i = 0; i < num_chunks; i++) {
+                    bitmap_set(&zpool_chunks, chunk + i, 1);
+                }
+                zpool_pages++;
+                zpool_bytes += size;
+            }
+            pthread_mutex_unlock(&zpool_lock);
+            if(chunk != BITMAP_NONE) {
+                unsigned char *stored = zpool + chunk * ZPOOL_CHUNK;
+                stored[0] = size & 0xff;
+                stored[1] = size >> 8;
+                memcpy(stored + 2, buffer, size);
+                return ((pte_t) chunk << num_offset_bits) | PTE_SWAPPED | PTE_COMPRESSED;
+            }
+        }
+    }
+
+    if(!swap_enabled) {
+        return 0;
+    }
+    unsigned long slot = alloc_swap_slot();
+    if(slot == BITMAP_NONE) {
+        return 0;
+    }
+    if(write_swap_slot(slot, frame) < 0) {
+        free_swap_slot(slot);
+        return 0;
+    }
+    return ((pte_t) slot << num_offset_bits) | PTE_SWAPPED;
+}
+
+/*
+Reads the page saved by store_page under entry into frame. Returns 0, or -1
+if the swap file cannot be read or a compressed copy fails to decode, which
+only happens if it was freed and reused under a fault that loses its race.
+*/
+int load_page(pte_t entry, void *frame) {
+    if(!(entry & PTE_COMPRESSED)) {
+        return read_swap_slot(entry >> num_offset_bits, frame);
+    }
+    struct vm_thread *thread = get_vm_thread();
+    unsigned long start = latency_start();
+    unsigned char *stored = zpool + (entry >> num_offset_bits) * ZPOOL_CHUNK;
+    unsigned int size = stored[0] | stored[1] << 8;
+    if(size > ZPOOL_MAX_SIZE || lz_decompress(stored + 2, size, frame, PGSIZE) < 0) {
+        return -1;
+    }
+    thread->stats.zpool_loads++;
+    record_latency(thread, VM_OP_DECOMPRESS, start);
+    return 0;
+}
+
+/*
+Frees the swap slot or pool chunks holding the page saved under entry, or
+just drops one mapping of them if a snapshot also maps them
+*/
+void free_stored_page(pte_t entry) {
+    if(!(entry & PTE_COMPRESSED)) {
+        unsigned long slot = entry >> num_offset_bits;
+        pthread_mutex_lock(&swap_lock);
+        if(swap_shares[slot]) {
+            swap_shares[slot]--;
+        }
+        else {
+            bitmap_set(&swap_slots, slot, 0);
+        }
+        pthread_mutex_unlock(&swap_lock);
+        return;
+    }
+    unsigned long chunk = entry >> num_offset_bits;
+    unsigned char *stored = zpool + chunk * ZPOOL_CHUNK;
+    unsigned int size = stored[0] | stored[1] << 8;
+    unsigned long num_chunks = (size + 2 + ZPOOL_CHUNK - 1) / ZPOOL_CHUNK;
+    pthread_mutex_lock(&zpool_lock);
+    if(zpool_shares[chunk]) {
+        zpool_shares[chunk]--;
+        pthread_mutex_unlock(&zpool_lock);
+        return;
+    }
+    for(unsigned long i = 0; i < num_chunks; i++) {
+        bitmap_set(&zpool_chunks, chunk + i, 0);
+    }
+    zpool_pages--;
+    zpool_bytes -= size;
+    pthread_mutex_unlock(&zpool_lock);
+}
+
+/*
+Gives the page saved under entry one more mapping, as long as pte still holds
+entry. The check is made under the lock free_stored_page takes, so a fault
+bringing the page back in either sees the extra mapping or has already
+replaced the entry. Returns false if the entry changed.
+*/
+bool share_stored_page(pte_t *pte, pte_t entry) {
+    bool compressed = entry & PTE_COMPRESSED;
+    pthread_mutex_t *stored_lock = compressed ? &zpool_lock : &swap_lock;
+    unsigned int *shares = compressed ? zpool_shares : swap_shares;
+    pthread_mutex_lock(stored_lock);
+    bool shared = __atomic_load_n(pte, __ATOMIC_ACQUIRE) == entry;
+    if(shared) {
+        shares[entry >> num_offset_bits]++;
+    }
+    pthread_mutex_unlock(stored_lock);
+    return shared;
+}
+
+static unsigned int lz_hash(const unsigned char *p) {
+    uint32_t sequence;
+    memcpy(&sequence, p, 4);
+    return (sequence * 2654435761U) >> (32 - ZPOOL_HASH_BITS);
+}
+
+/*
+Appends one LZ sequence to out: a token with the literal count in its high
+nibble and the match length minus 4 in its low one, counts of 15 or more
+continued in 255 valued bytes, the literals, then unless match_len is 0 the
+match offset in two bytes. Returns the new output length, or 0 if it would
+pass out_max.
+*/
+static unsigned int lz_emit(unsigned char *out, unsigned int length, unsigned int out_max,
+    const unsigned char *literals, unsigned int num_literals, unsigned int offset, unsigned int match_len) {
+    unsigned int extra = match_len ? match_len - 4 : 0;
+    if(length + 1 + num_literals / 255 + 1 + num_literals + 2 + extra / 255 + 1 > out_max) {
+        return 0;
+    }
+    unsigned char *token = &out[length++];
+    *token = (num_literals < 15 ? num_literals : 15) << 4;
+    if(num_literals >= 15) {
+        unsigned int count = num_literals - 15;
+        for(; count >= 255; count -= 255) {
+            out[length++] = 255;
+        }
+        out[length++] = count;
+    }
+    memcpy(out + length, literals, num_literals);
+    length += num_literals;
+    if(!match_len) {
+        return length;
+    }
+
+    out[length++] = offset & 0xff;
+    out[length++] = offset >> 8;
+    *token |= extra < 15 ? extra : 15;
+    if(extra >= 15) {
+        unsigned int count = extra - 15;
+        for(; count >= 255; count -= 255) {
+            out[length++] = 255;
+        }
+        out[length++] = count;
+    }
+    return length;
+}
+
+/*
+Compresses in_len bytes, at most 64 KB, with a greedy LZ77 pass that finds
+4 byte matches through a small hash table of recent positions. Runs of equal
+bytes become a single overlapping match. Returns the compressed size, or 0 if
+it would be larger than out_max.
+*/
+unsigned int lz_compress(const unsigned char *in, unsigned int in_len, unsigned char *out, unsigned int out_max) {
+    uint16_t table[1 << ZPOOL_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    unsigned int anchor = 0, pos = 0, length = 0;
+
+    while(pos + 4 <= in_len) {
+        unsigned int hash = lz_hash(in + pos);
+        unsigned int candidate = table[hash];
+        table[hash] = pos + 1;
+        if(!candidate || memcmp(in + candidate - 1, in + pos, 4)) {
+            pos++;
+            continue;
+        }
+
+        unsigned int match = candidate - 1;
+        unsigned int match_len = 4;
+        while(pos + match_len < in_len && in[match + match_len] == in[pos + match_len]) {
+            match_len++;
+        }
+        length = lz_emit(out, length, out_max, in + anchor, pos - anchor, pos - match, match_len);
+        if(!length) {
+            return 0;
+        }
+        pos += match_len;
+        anchor = pos;
+    }
+    return lz_emit(out, length, out_max, in + anchor, in_len - anchor, 0, 0);
+}
+
+/*
+Expands what lz_compress wrote back into exactly out_len bytes. Every count
+and offset is checked, so corrupt input never reads or writes out of bounds.
+Returns 0 on success and -1 if the input is malformed.
+*/
+int lz_decompress(const unsigned char *in, unsigned int in_len, unsigned char *out, unsigned int out_len) {
+    unsigned int in_pos = 0, out_pos = 0;
+    while(in_pos < in_len) {
+        unsigned int token = in[in_pos++];
+        unsigned int num_literals = token >> 4;
+        if(num_literals == 15) {
+            unsigned char count;
+            do {
+                if(in_pos >= in_len) {
+                    return -1;
+                }
+                count = in[in_pos++];
+                num_literals += count;
+            } while(count == 255);
+        }
+        if(num_literals > in_len - in_pos || num_literals > out_len - out_pos) {
+            return -1;
+        }
+        memcpy(out + out_pos, in + in_pos, num_literals);
+        in_pos += num_literals;
+        out_pos += num_literals;
+
+        //The last sequence has no match
+        if(in_pos == in_len) {
+            break;
+        }
+        if(in_len - in_pos < 2) {
+            return -1;
+        }
+        unsigned int offset = in[in_pos] | in[in_pos + 1] << 8;
+        in_pos += 2;
+        unsigned int match_len = (token & 15) + 4;
+        if((token & 15) == 15) {
+            unsigned char count;
+            do {
+                if(in_pos >= in_len) {
+                    return -1;
+                }
+                count = in[in_pos++];
+                match_len += count;
+            } while(count == 255);
+        }
+        if(offset == 0 || offset > out_pos || match_len > out_len - out_pos) {
+            return -1;
+        }
+
+        //Overlapping matches repeat the bytes just written, so they are copied
+        //one at a time
+        unsigned char *from = out + out_pos - offset;
+        if(offset >= match_len) {
+            memcpy(out + out_pos, from, match_len);
+        }
+        else {
+            for(unsigned int i = 0; i < match_len; i++) {
+                out[out_pos + i] = from[i];
+            }
+        }
+        out_pos += match_len;
+    }
+    return out_pos == out_len ? 0 : -1;
+}
+
+/*
+Wakes the swap daemon if free frames have fallen below the low watermark.
+Never blocks for long, so it is safe inside read sections.
+*/
+void wake_swap_daemon() {
+    if(!evict_enabled || __atomic_load_n(&physical_frames.free_count, __ATOMIC_RELAXED) >= swap_low_watermark) {
+        return;
+    }
+    pthread_mutex_lock(&swap_wait_lock);
+    swap_wakeup = true;
+    pthread_cond_signal(&swap_cond);
+    pthread_mutex_unlock(&swap_wait_lock);
+}
+
+/*
+Background thread that swaps out batches of cold pages until free frames are
+back above the high watermark, so faults rarely have to reclaim themselves
+*/
+void *swap_daemon(void *arg) {
+    (void) arg;
+    while(true) {
+        pthread_mutex_lock(&swap_wait_lock);
+        while(!swap_wakeup) {
+            pthread_cond_wait(&swap_cond, &swap_wait_lock);
+        }
+        swap_wakeup = false;
+        pthread_mutex_unlock(&swap_wait_lock);
+
+        unsigned int evicted = 1;
+        while(evicted > 0 && __atomic_load_n(&physical_frames.free_count, __ATOMIC_RELAXED) < swap_high_watermark) {
+            evicted = reclaim_frames(SWAP_BATCH);
+        }
+    }
+    return NULL;
+}
+
+/*
+Swaps out up to num_frames pages of any context and returns how many were
+freed. Takes the locks, so it must not be called inside a read section or
+while holding the lock of a context.
+*/
+unsigned int reclaim_frames(unsigned int num_frames) {
+    unsigned int evicted = 0;
+    pthread_mutex_lock(&lock);
+    for(struct vm_context *ctx = vm_contexts; ctx && evicted < num_frames; ctx = ctx->next) {
+        lock_vm(ctx);
+        evicted += evict_frames(ctx, num_frames - evicted);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return evicted;
+}
+
+/*
+Evicts up to num_frames (at most SWAP_BATCH) pages of ctx and returns how
+many frames were freed. The lock of ctx must be held. Its clock hand sweeps
+the frames, clearing accessed bits and picking frames mapped by ctx, unpinned,
+unshared and outside superpages, that were not accessed since its last pass.
+Victims are marked PTE_SWAPPING, then one TLB shootdown and grace period
+covers the whole batch before they are stored, compressed in the pool when
+they fit and in the swap file otherwise. A victim touched in between has its
+eviction cancelled by the fault.
+*/
+int evict_frames(struct vm_context *ctx, unsigned int num_frames) {
+    if(!evict_enabled) {
+        return 0;
+    }
+    if(num_frames > SWAP_BATCH) {
+        num_frames = SWAP_BATCH;
+    }
+
+    pte_t *victim_ptes[SWAP_BATCH];
+    pte_t victim_entries[SWAP_BATCH];
+    unsigned int num_victims = 0;
+
+    //Two sweeps are enough to find every frame whose accessed bit was cleared
+    for(unsigned long scanned = 0; scanned < 2 * num_physical_pages && num_victims < num_frames; scanned++) {
+        unsigned long frame_index = ctx->clock_hand;
+        ctx->clock_hand = (ctx->clock_hand + 1) % num_physical_pages;
+
+        //Other contexts update their frames under their own locks, and only
+        //the lock of the context owning the page table keeps the entry from
+        //being freed while it is looked at
+        struct frame_info *frame = &frame_table[frame_index];
+        pte_t *pte = __atomic_load_n(&frame->pte, __ATOMIC_RELAXED);
+        if(!pte || __atomic_load_n(&get_frame_info(pte)->owner, __ATOMIC_RELAXED) != ctx || frame->pin_count) {
+            continue;
+        }
+        pte_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+        if(pte_frame(entry) != get_physical_addr_from_bit(frame_index) || (entry & PTE_LARGE) || frame->shares) {
+            continue;
+        }
+        if(entry & PTE_ACCESSED) {
+            __atomic_fetch_and(pte, ~(pte_t) PTE_ACCESSED, __ATOMIC_RELAXED);
+            continue;
+        }
+        if(__atomic_compare_exchange_n(pte, &entry, entry | PTE_SWAPPING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            victim_ptes[num_victims] = pte;
+            victim_entries[num_victims] = entry | PTE_SWAPPING;
+            num_victims++;
+        }
+    }
+    if(num_victims == 0) {
+        return 0;
+    }
+
+    //Nobody may still be writing through an old translation while a page is
+    //copied out
+    tlb_shootdown(ctx);
+    synchronize_readers();
+
+    int evicted = 0;
+    for(unsigned int i = 0; i < num_victims; i++) {
+        pte_t entry = victim_entries[i];
+        void *pa = (void*) (entry & ~PTE_FLAGS);
+        //A fault may cancel the eviction and write the page during the copy,
+        //in which case the exchange below fails and the copy is dropped
+        pte_t swapped = store_page(pa);
+        if(swapped) {
+            if(__atomic_compare_exchange_n(victim_ptes[i], &entry, swapped, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                get_frame_info(pa)->pte = NULL;
+                free_frames(pa, 1);
+                __atomic_fetch_add((swapped & PTE_COMPRESSED) ? &zpool_stores : &swap_outs, 1, __ATOMIC_RELAXED);
+                evicted++;
+                continue;
+            }
+            free_stored_page(swapped);
+            continue;
+        }
+
+        //Nowhere to put the page, so put it back
+        __atomic_compare_exchange_n(victim_ptes[i], &entry, entry & ~PTE_SWAPPING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    return evicted;
+}
+
+/*
+Merges the pages of the default address space that hold the same contents
+into one copy on write frame and maps pages holding only zeros to the zero
+page. Returns the number of frames freed.
+*/
+int t_merge_pages() {
+    return t_vm_merge_pages(&default_context);
+}
+
+/*
+t_merge_pages of the address space of ctx
+*/
+int t_vm_merge_pages(struct vm_context *ctx) {
+    if(!__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    lock_vm(ctx);
+    int freed = merge_frames(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    return freed;
+}
+
+static int compare_candidates(const void *a, const void *b) {
+    const struct merge_candidate *x = a, *y = b;
+    if(x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return (x->vpn > y->vpn) - (x->vpn < y->vpn);
+}
+
+uint64_t hash_page(const void *page) {
+    const uint64_t *words = page;
+    uint64_t hash = 0xcbf29ce484222325UL;
+    for(unsigned long i = 0; i < PGSIZE / sizeof(uint64_t); i++) {
+        hash = (hash ^ words[i]) * 0x100000001b3UL;
+    }
+    return hash;
+}
+
+/*
+Frees the frames of ctx whose contents another frame of ctx or the zero page
+already holds and returns how many. The lock of ctx must be held. Present
+pages of ctx that are mapped once and unpinned are hashed, and those whose
+hash matches another or the zero page are marked PTE_SWAPPING like eviction
+victims, splitting their superpage first. After one TLB shootdown and grace
+period nobody can write them, so the lowest page of each group becomes the
+copy on write original and the others are compared against it and mapped to
+it. A page touched in between has its merge cancelled by the fault.
+*/
+int merge_frames(struct vm_context *ctx) {
+    struct merge_candidate *candidates = malloc(num_physical_pages * sizeof(struct merge_candidate));
+    unsigned long num_candidates = 0;
+    if(!candidates) {
+        return 0;
+    }
+
+    //The hashes only pick candidates, the comparison after the grace period
+    //decides
+    find_merge_candidates(ctx, ctx->page_directory, VM_LEVELS - 1, 0, candidates, &num_candidates);
+    qsort(candidates, num_candidates, sizeof(struct merge_candidate), compare_candidates);
+
+    uint64_t zero_hash = hash_page(zero_page);
+    unsigned long num_marked = 0;
+    for(unsigned long first = 0, last; first < num_candidates; first = last) {
+        for(last = first + 1; last < num_candidates && candidates[last].hash == candidates[first].hash; last++);
+        bool mergeable = last - first > 1 || candidates[first].hash == zero_hash;
+        for(unsigned long i = first; i < last; i++) {
+            pte_t entry = candidates[i].entry;
+            if(mergeable && (entry & PTE_LARGE)) {
+                demote_superpage(ctx, (void*) (candidates[i].vpn << num_offset_bits));
+                entry = __atomic_load_n(candidates[i].pte, __ATOMIC_ACQUIRE);
+                if(pte_frame(entry) != pte_frame(candidates[i].entry)) {
+                    candidates[i].pte = NULL;
+                    continue;
+                }
+            }
+            if(mergeable && __atomic_compare_exchange_n(candidates[i].pte, &entry, entry | PTE_SWAPPING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                candidates[i].entry = entry | PTE_SWAPPING;
+                num_marked++;
+            }
+            else {
+                candidates[i].pte = NULL;
+            }
+        }
+    }
+    if(num_marked == 0) {
+        free(candidates);
+        return 0;
+    }
+
+    tlb_shootdown(ctx);
+    synchronize_readers();
+
+    int freed = 0;
+    for(unsigned long first = 0, last; first < num_candidates; first = last) {
+        for(last = first + 1; last < num_candidates && candidates[last].hash == candidates[first].hash; last++);
+        void *original = candidates[first].hash == zero_hash ? zero_page : NULL;
+        pte_t *original_pte = NULL;
+        pte_t original_entry = 0;
+        int group_freed = 0;
+
+        for(unsigned long i = first; i < last; i++) {
+            pte_t *pte = candidates[i].pte;
+            pte_t entry = candidates[i].entry;
+            void *pa = (void*) (entry & ~PTE_FLAGS);
+            if(!pte) {
+                continue;
+            }
+
+            //The original is made copy on write before anything is compared
+            //with it, so it cannot change while it gains mappings
+            if(!original) {
+                pte_t shared = (entry & ~(pte_t) PTE_SWAPPING) | PTE_COW;
+                if(__atomic_compare_exchange_n(pte, &entry, shared, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    original = pa;
+                    original_pte = pte;
+                    original_entry = shared;
+                }
+                continue;
+            }
+
+            if(memcmp(pa, original, PGSIZE) == 0) {
+                //The share is taken first so the original is never written
+                //in place while this page maps it
+                struct frame_info *info = original == zero_page ? NULL : get_frame_info(original);
+                if(info) {
+                    add_share(info);
+                }
+                if(__atomic_compare_exchange_n(pte, &entry, (pte_t) original | PTE_COW, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    get_frame_info(pa)->pte = NULL;
+                    free_frames(pa, 1);
+                    __atomic_fetch_add(info ? &pages_merged : &zero_pages_merged, 1, __ATOMIC_RELAXED);
+                    group_freed++;
+                    continue;
+                }
+                if(info) {
+                    drop_share(info);
+                }
+                continue;
+            }
+            __atomic_compare_exchange_n(pte, &entry, entry & ~PTE_SWAPPING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        }
+
+        //An original nothing was merged into goes back to being private
+        if(original_pte && group_freed == 0) {
+            __atomic_compare_exchange_n(original_pte, &original_entry, original_entry & ~(pte_t) PTE_COW, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        }
+        freed += group_freed;
+    }
+    free(candidates);
+    return freed;
+}
+
+/*
+Adds the pages under the table at level of ctx that a merge pass may free to
+candidates, with level 0 being the page tables. first_vpn is the first page
+the table covers. The lock of ctx must be held.
+*/
+void find_merge_candidates(struct vm_context *ctx, pde_t *table, int level, unsigned long first_vpn, struct merge_candidate *candidates, unsigned long *num_candidates) {
+    unsigned long num_entries = 1UL << (level == VM_LEVELS - 1 ? num_page_directory_bits : num_page_table_bits);
+    for(unsigned long i = 0; i < num_entries; i++) {
+        pte_t entry = __atomic_load_n(&table[i], __ATOMIC_ACQUIRE);
+        unsigned long vpn = first_vpn + (i << (level * num_page_table_bits));
+        if(level > 0) {
+            if(entry) {
+                find_merge_candidates(ctx, (pde_t*) (entry & ~PTE_FLAGS), level - 1, vpn, candidates, num_candidates);
+            }
+            continue;
+        }
+
+        void *pa = pte_frame(entry);
+        if(!pa || pa == zero_page) {
+            continue;
+        }
+        struct frame_info *frame = get_frame_info(pa);
+        if(frame->pin_count || __atomic_load_n(&frame->shares, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        struct merge_candidate *candidate = &candidates[(*num_candidates)++];
+        candidate->hash = hash_page(pa);
+        candidate->vpn = vpn;
+        candidate->pte = &table[i];
+        candidate->entry = entry;
+    }
+}
+
+/*
+Copies size bytes between val and the virtual range starting at va inside an
+already entered read section, translating each page once through cache.
+Returns -1 without copying anything if part of the range is not mapped when
+the copy starts. Pages are then copied in order, and the copy stops at the
+first page that cannot be used with the bytes before it already copied: -1 if
+a racing t_free unmapped it, VM_NO_MEMORY if it could not be faulted in for
+lack of free frames, VM_IO_ERROR if it could not be read back from swap and
+VM_COPY_ON_WRITE if it is to be written but is shared with a snapshot. The
+caller retries the whole range once VM_NO_MEMORY or VM_COPY_ON_WRITE is
+resolved.
+*/
+int copy_range(struct vm_context *ctx, struct page_cache *cache, void *va, void *val, unsigned long size, bool write) {
+    unsigned long offset = (unsigned long) va & (PGSIZE - 1);
+    unsigned long bytesToCopy;
+
+    //Ranges that cross a page boundary are checked up front so an unmapped
+    //range leaves nothing half written
+    if(offset + size > PGSIZE && !range_is_mapped(ctx, va, size)) {
+        return -1;
+    }
+
+    while(size > 0) {
+        //Copy up to the end of the current page
+        bytesToCopy = PGSIZE - offset;
+        if(bytesToCopy > size) {
+            bytesToCopy = size;
+        }
+
+        void *pa = get_cached_page(ctx, cache, va, write);
+        if(!pa && cache->cow_va) {
+            cache->cow_size = size;
+            return VM_COPY_ON_WRITE;
+        }
+        if(!pa) {
+            return range_is_mapped(ctx, va, 1) ? cache->error : -1;
+        }
+
+        if(write) {
+            memcpy(pa + offset, val, bytesToCopy);
+        }
+        else {
+            memcpy(val, pa + offset, bytesToCopy);
+        }
+
+        //Move on to the start of the next page
+        va = (void*) ((unsigned long) va + bytesToCopy);
+        val = (void*) ((unsigned long) val + bytesToCopy);
+        size -= bytesToCopy;
+        offset = 0;
+    }
+    return 0;
+}
+
+/*
+Copies every descriptor of a vectored get_values/put_values call inside one
+read section. Consecutive descriptors on the same page share one translation.
+*/
+static int copy_values(struct vm_context *ctx, struct t_iovec *iov, int count, bool write) {
+    struct vm_thread *thread = get_vm_thread();
+    struct page_cache cache = { .vpn = BITMAP_NONE };
+    int ret = 0;
+
+    enter_read_section(thread);
+    if(!__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE)) {
+        ret = -1;
+    }
+    for(int i = 0; i < count && ret == 0; i++) {
+        if(iov[i].size < 0) {
+            ret = -1;
+            break;
+        }
+        ret = copy_range(ctx, &cache, iov[i].va, iov[i].buf, iov[i].size, write);
+        while(ret <= VM_NO_MEMORY && resolve_in_read_section(ctx, thread, &cache, ret)) {
+            ret = copy_range(ctx, &cache, iov[i].va, iov[i].buf, iov[i].size, write);
+        }
+    }
+    exit_read_section(thread);
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+Copies count elements of elem_size bytes, stride bytes apart in the virtual
+range, to or from back to back slots in buf, inside one read section
+*/
+static int copy_strided(struct vm_context *ctx, struct t_strided *desc, bool write) {
+    struct vm_thread *thread = get_vm_thread();
+    struct page_cache cache = { .vpn = BITMAP_NONE };
+    int ret = 0;
+
+    enter_read_section(thread);
+    if(!__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE)) {
+        ret = -1;
+    }
+    void *va = desc->va;
+    void *buf = desc->buf;
+    for(unsigned int i = 0; i < desc->count && ret == 0; i++) {
+        ret = copy_range(ctx, &cache, va, buf, desc->elem_size, write);
+        while(ret <= VM_NO_MEMORY && resolve_in_read_section(ctx, thread, &cache, ret)) {
+            ret = copy_range(ctx, &cache, va, buf, desc->elem_size, write);
+        }
+        va = (void*) ((unsigned long) va + desc->stride);
+        buf = (void*) ((unsigned long) buf + desc->elem_size);
+    }
+    exit_read_section(thread);
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+Vectored versions of put_value and get_value. Each descriptor is copied as by
+put_value/get_value, but the whole batch runs in a single read section and
+reuses translations across descriptors on the same page. Return 0 on success
+and -1 at the first descriptor that is not mapped; descriptors before it have
+been copied.
+*/
+int put_values(struct t_iovec *iov, int count) {
+    return copy_values(&default_context, iov, count, true);
+}
+
+int get_values(struct t_iovec *iov, int count) {
+    return copy_values(&default_context, iov, count, false);
+}
+
+/*
+put_values, get_values, put_strided and get_strided on the address space of ctx
+*/
+int t_vm_put_values(struct vm_context *ctx, struct t_iovec *iov, int count) {
+    return copy_values(ctx, iov, count, true);
+}
+
+int t_vm_get_values(struct vm_context *ctx, struct t_iovec *iov, int count) {
+    return copy_values(ctx, iov, count, false);
+}
+
+/*
+Strided versions of put_values and get_values, for walking a matrix column
+or any other constant-stride sequence of elements in one call
+*/
+int put_strided(struct t_strided *desc) {
+    return copy_strided(&default_context, desc, true);
+}
+
+int get_strided(struct t_strided *desc) {
+    return copy_strided(&default_context, desc, false);
+}
+
+int t_vm_put_strided(struct vm_context *ctx, struct t_strided *desc) {
+    return copy_strided(ctx, desc, true);
+}
+
+int t_vm_get_strided(struct vm_context *ctx, struct t_strided *desc) {
+    return copy_strided(ctx, desc, false);
+}
+
+/*
+Copies n bytes from src to dst inside the VM, frame to frame, without a
+bounce buffer. The whole copy runs in one read section and every physically
+contiguous run of both ranges is copied with a single memcpy. t_memmove also
+handles overlapping ranges and t_memset fills n bytes with value. All return
+0 on success and -1 if part of a range is not mapped, in which case nothing
+is written.
+*/
+int t_memcpy(void *dst, void *src, unsigned long n) {
+    return t_vm_memcpy(&default_context, dst, src, n);
+}
+
+int t_memmove(void *dst, void *src, unsigned long n) {
+    return t_vm_memmove(&default_context, dst, src, n);
+}
+
+int t_memset(void *va, int value, unsigned long n) {
+    return t_vm_memset(&default_context, va, value, n);
+}
+
+int t_vm_memcpy(struct vm_context *ctx, void *dst, void *src, unsigned long n) {
+    return move_memory(ctx, dst, src, 0, n, false);
+}
+
+int t_vm_memmove(struct vm_context *ctx, void *dst, void *src, unsigned long n) {
+    //Copying from the end keeps a source that overlaps the end of the
+    //destination intact until it is read
+    bool backward = (unsigned long) dst > (unsigned long) src && (unsigned long) dst < (unsigned long) src + n;
+    return move_memory(ctx, dst, src, 0, n, backward);
+}
+
+int t_vm_memset(struct vm_context *ctx, void *va, int value, unsigned long n) {
+    return move_memory(ctx, va, NULL, value, n, false);
+}
+
+/*
+Copies n bytes from src to dst, or fills them with value if src is NULL,
+inside one read section. Both ranges are checked up front, and progress is
+kept across faults so an overlapping move is never redone.
+*/
+int move_memory(struct vm_context *ctx, void *dst, void *src, int value, unsigned long n, bool backward) {
+    if(n == 0) {
+        return 0;
+    }
+    struct vm_thread *thread = get_vm_thread();
+    struct page_cache dst_cache = { .vpn = BITMAP_NONE };
+    struct page_cache src_cache = { .vpn = BITMAP_NONE };
+    unsigned long start = latency_start();
+    int ret = -1;
+
+    enter_read_section(thread);
+    if(__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE) && range_is_mapped(ctx, dst, n) && (!src || range_is_mapped(ctx, src, n))) {
+        ret = move_range(ctx, &dst_cache, &src_cache, &dst, &src, value, &n, backward);
+        while(ret <= VM_NO_MEMORY && resolve_in_read_section(ctx, thread, &dst_cache, ret)) {
+            src_cache.vpn = BITMAP_NONE;
+            ret = move_range(ctx, &dst_cache, &src_cache, &dst, &src, value, &n, backward);
+        }
+    }
+    exit_read_section(thread);
+    record_latency(thread, src ? VM_OP_COPY : VM_OP_SET, start);
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+Moves the n bytes left of a t_memcpy, t_memmove or t_memset inside an already
+entered read section, advancing dst, src and n past every byte done so the
+call can resume after a fault. Forward moves go a contiguous run at a time;
+backward ones go a page at a time from the end. Returns 0 when done,
+VM_NO_MEMORY or VM_IO_ERROR if a page could not be faulted in and
+VM_COPY_ON_WRITE if a destination page is shared, with the rest of the
+destination left in dst_cache for copy_on_write.
+*/
+int move_range(struct vm_context *ctx, struct page_cache *dst_cache, struct page_cache *src_cache, void **dst, void **src, int value, unsigned long *n, bool backward) {
+    while(*n > 0) {
+        void *to = NULL, *from = NULL;
+        unsigned long chunk;
+        if(backward) {
+            //Bytes from the start of the last page of either range to the end
+            unsigned long dst_tail = (((unsigned long) *dst + *n - 1) & (PGSIZE - 1)) + 1;
+            unsigned long src_tail = (((unsigned long) *src + *n - 1) & (PGSIZE - 1)) + 1;
+            chunk = dst_tail < src_tail ? dst_tail : src_tail;
+            if(chunk > *n) {
+                chunk = *n;
+            }
+            from = get_cached_run(ctx, src_cache, *src + *n - chunk, chunk, false, &chunk);
+            if(from) {
+                to = get_cached_run(ctx, dst_cache, *dst + *n - chunk, chunk, true, &chunk);
+            }
+        }
+        else {
+            chunk = *n;
+            if(*src) {
+                from = get_cached_run(ctx, src_cache, *src, chunk, false, &chunk);
+            }
+            if(from || !*src) {
+                to = get_cached_run(ctx, dst_cache, *dst, chunk, true, &chunk);
+            }
+        }
+        if(*src && !from) {
+            return range_is_mapped(ctx, *src, 1) ? src_cache->error : -1;
+        }
+        if(!to && dst_cache->cow_va) {
+            dst_cache->cow_va = *dst;
+            dst_cache->cow_size = *n;
+            return VM_COPY_ON_WRITE;
+        }
+        if(!to) {
+            return range_is_mapped(ctx, *dst, 1) ? dst_cache->error : -1;
+        }
+
+        //The ranges may share frames, which memmove allows for
+        if(*src) {
+            memmove(to, from, chunk);
+        }
+        else {
+            memset(to, value, chunk);
+        }
+        *n -= chunk;
+        if(!backward) {
+            *dst += chunk;
+            if(*src) {
+                *src += chunk;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+Returns the host address of va and sets run to how many of the n bytes from
+va on are physically contiguous behind it, following the next pages while
+their frames are adjacent. Must be called inside a read section. Returns NULL
+if the first page is not present, like get_cached_page.
+*/
+void *get_cached_run(struct vm_context *ctx, struct page_cache *cache, void *va, unsigned long n, bool write, unsigned long *run) {
+    void *page = get_cached_page(ctx, cache, va, write);
+    if(!page) {
+        return NULL;
+    }
+    void *pa = page + ((unsigned long) va & (PGSIZE - 1));
+    unsigned long length = PGSIZE - ((unsigned long) va & (PGSIZE - 1));
+
+    //Pages still on the zero page are never adjacent, and a following page
+    //that cannot be used right now just ends the run
+    while(length < n && page != zero_page) {
+        void *next = get_cached_page(ctx, cache, va + length, write);
+        if(next != pa + length) {
+            cache->cow_va = NULL;
+            break;
+        }
+        length += PGSIZE;
+    }
+    *run = length < n ? length : n;
+    return pa;
+}
+
+/*
+Pins the size bytes starting at va and fills view with direct host pointers to
+the frames backing them, one iovec per physically contiguous run. The frames
+stay valid, even if the range is freed with t_free, until t_unpin is called
+on the view. Returns 0 on success and -1, with nothing pinned, if part of
+the range is not mapped or memory runs out.
+*/
+int t_pin(void *va, unsigned long size, struct t_view *view) {
+    return t_vm_pin(&default_context, va, size, view);
+}
+
+/*
+t_pin on the address space of ctx
+*/
+int t_vm_pin(struct vm_context *ctx, void *va, unsigned long size, struct t_view *view) {
+    memset(view, 0, sizeof(struct t_view));
+    if(size == 0 || !__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    lock_vm(ctx);
+    if(!range_is_mapped(ctx, va, size)) {
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+
+    unsigned long first_vpn = (unsigned long) va >> num_offset_bits;
+    unsigned long last_vpn = ((unsigned long) va + size - 1) >> num_offset_bits;
+    view->iov = malloc((last_vpn - first_vpn + 1) * sizeof(struct iovec));
+    if(!view->iov) {
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+    view->va = va;
+    view->size = size;
+    view->context = ctx;
+
+    unsigned long offset = (unsigned long) va & (PGSIZE - 1);
+    unsigned long bytesRemaining = size;
+    while(bytesRemaining > 0) {
+        unsigned long bytesInPage = PGSIZE - offset;
+        if(bytesInPage > bytesRemaining) {
+            bytesInPage = bytesRemaining;
+        }
+
+        //Pages not yet backed under demand paging, or swapped out, are brought
+        //in, and pages shared with a snapshot get a frame of their own
+        pte_t *pte = translate(ctx, va);
+        if(break_cow(ctx, pte, va) < 0) {
+            pthread_mutex_unlock(&ctx->lock);
+            t_unpin(view);
+            return -1;
+        }
+        void *frame = pte_frame(*pte);
+        int error = VM_NO_MEMORY;
+        while(!frame) {
+            frame = handle_page_fault(pte, &error);
+            if(frame || error == VM_IO_ERROR || evict_frames(ctx, SWAP_BATCH) == 0) {
+                break;
+            }
+        }
+        if(!frame) {
+            pthread_mutex_unlock(&ctx->lock);
+            t_unpin(view);
+            return -1;
+        }
+        void *pa = frame + offset;
+        get_frame_info(frame)->pin_count++;
+
+        //Extend the last run when this frame directly follows it
+        struct iovec *last = view->iov_count ? &view->iov[view->iov_count - 1] : NULL;
+        if(last && last->iov_base + last->iov_len == pa) {
+            last->iov_len += bytesInPage;
+        }
+        else {
+            view->iov[view->iov_count].iov_base = pa;
+            view->iov[view->iov_count].iov_len = bytesInPage;
+            view->iov_count++;
+        }
+
+        va = (void*) ((unsigned long) va + bytesInPage);
+        bytesRemaining -= bytesInPage;
+        offset = 0;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/*
+Releases the frames pinned by t_pin. Frames whose pages were freed while
+pinned are returned to the allocator once their last pin is dropped.
+*/
+void t_unpin(struct t_view *view) {
+    if(!view->context) {
+        return;
+    }
+    lock_vm(view->context);
+    for(int i = 0; i < view->iov_count; i++) {
+        void *first = view->iov[i].iov_base - ((unsigned long) (view->iov[i].iov_base - physical_mem) & (PGSIZE - 1));
+        void *end = view->iov[i].iov_base + view->iov[i].iov_len;
+        for(void *pa = first; pa < end; pa += PGSIZE) {
+            struct frame_info *frame = get_frame_info(pa);
+            frame->pin_count--;
+            if(frame->pin_count == 0 && (frame->flags & FRAME_FREE_DEFERRED)) {
+                frame->flags &= ~FRAME_FREE_DEFERRED;
+                free_frames(pa, 1);
+            }
+        }
+    }
+    pthread_mutex_unlock(&view->context->lock);
+
+    free(view->iov);
+    memset(view, 0, sizeof(struct t_view));
+}
+
+/*
+Takes a copy on write snapshot of the whole address space. Only the page
+tables are copied: every frame is shared between the live pages and the
+snapshot until a write to a live page gives it a frame of its own, so taking
+a snapshot costs time and memory for the tables and later only for the pages
+that diverge. Swapped out pages share their saved copy instead. Shared frames
+cannot be evicted, so once pages have somewhere to go the snapshot shares at
+most half of memory and saves the rest of its pages to the pool or swap file,
+which keeps the live address space able to page. Writes still running when
+this returns may or may not be seen by the snapshot. Returns NULL if memory
+runs out.
+*/
+struct vm_snapshot *t_snapshot() {
+    return t_vm_snapshot(&default_context);
+}
+
+/*
+t_snapshot of the address space of ctx
+*/
+struct vm_snapshot *t_vm_snapshot(struct vm_context *ctx) {
+    if(!__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    lock_vm(ctx);
+    struct vm_snapshot *snapshot = snapshot_context(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    return snapshot;
+}
+
+/*
+Takes a snapshot of ctx. Lock of ctx must be held. Returns NULL if memory
+runs out.
+*/
+struct vm_snapshot *snapshot_context(struct vm_context *ctx) {
+    unsigned long num_directory_entries = 1UL << num_page_directory_bits;
+    unsigned long num_directory_frames = (num_directory_entries * sizeof(pde_t) + PGSIZE - 1) / PGSIZE;
+    struct vm_snapshot *snapshot = calloc(1, sizeof(struct vm_snapshot));
+    if(!snapshot) {
+        return NULL;
+    }
+    snapshot->page_directory = alloc_frames(num_directory_frames);
+    if(!snapshot->page_directory) {
+        free(snapshot);
+        return NULL;
+    }
+    memset(snapshot->page_directory, 0, num_directory_entries * sizeof(pde_t));
+    for(unsigned long i = 0; i < num_directory_frames; i++) {
+        get_frame_info((void*) snapshot->page_directory + i * PGSIZE)->owner = NULL;
+    }
+
+    if(clone_table(ctx, ctx->page_directory, snapshot->page_directory, VM_LEVELS - 1, 0, snapshot) < 0) {
+        t_snapshot_free(snapshot);
+        return NULL;
+    }
+
+    //A write that started before its page was shared may still be writing
+    //the frame through its page cache, so wait for it to finish
+    synchronize_readers();
+
+    //Shared frames cannot be evicted, so past half of memory the snapshot
+    //keeps a saved copy instead and leaves the frame to the live page
+    if(__atomic_load_n(&evict_enabled, __ATOMIC_ACQUIRE)) {
+        spill_snapshot_table(snapshot->page_directory, VM_LEVELS - 1);
+    }
+    return snapshot;
+}
+
+/*
+Fills copy, a zeroed table of a snapshot, from the live table at level, with
+level 0 being the page tables. first_vpn is the first page the table covers.
+Directory entries are cloned recursively. Present frames are shared: both
+entries get PTE_COW and the frame gets one more share. Pages never written
+map the zero page, swapped out pages share their saved copy, pages being
+swapped out are read back in first, and pinned frames, which can be written
+without going through the page tables, are copied. Pages already mapping the
+zero page are copied as they are. Lock of ctx must be held. Returns -1 if
+memory runs out.
+*/
+int clone_table(struct vm_context *ctx, pde_t *table, pde_t *copy, int level, unsigned long first_vpn, struct vm_snapshot *snapshot) {
+    unsigned long num_entries = 1UL << (level == VM_LEVELS - 1 ? num_page_directory_bits : num_page_table_bits);
+    for(unsigned long i = 0; i < num_entries; i++) {
+        pte_t *pte = &table[i];
+        pte_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+        unsigned long vpn = first_vpn + (i << (level * num_page_table_bits));
+
+        if(level > 0) {
+            if(!entry) {
+                continue;
+            }
+            pde_t *child = alloc_page_table(ctx);
+            if(!child) {
+                return -1;
+            }
+            get_frame_info(child)->owner = NULL;
+            copy[i] = (pde_t) child;
+            if(clone_table(ctx, (pde_t*) (entry & ~PTE_FLAGS), child, level - 1, vpn, snapshot) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if(!entry) {
+            if(bitmap_get(&ctx->virtual_bitmap, vpn)) {
+                copy[i] = (pte_t) zero_page | PTE_COW;
+                snapshot->num_pages++;
+            }
+            continue;
+        }
+
+        //The saved copy never changes, and a fault on the live page gives it
+        //a frame of its own, so both simply map it. A fault that got there
+        //first leaves a present page behind.
+        while((entry & PTE_NOT_PRESENT) == PTE_SWAPPED && !share_stored_page(pte, entry)) {
+            entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+        }
+        if((entry & PTE_NOT_PRESENT) == PTE_SWAPPED) {
+            copy[i] = entry;
+            snapshot->num_pages++;
+            continue;
+        }
+
+        void *frame = pte_frame(entry);
+        int error = VM_NO_MEMORY;
+        while(!frame) {
+            frame = handle_page_fault(pte, &error);
+            if(frame || error == VM_IO_ERROR || evict_frames(ctx, SWAP_BATCH) == 0) {
+                break;
+            }
+        }
+        if(!frame) {
+            return -1;
+        }
+
+        struct frame_info *info = get_frame_info(frame);
+        if(frame == zero_page) {
+            copy[i] = (pte_t) zero_page | PTE_COW;
+        }
+        else if(info->pin_count) {
+            void *private = copy_frame(ctx, frame);
+            if(!private) {
+                return -1;
+            }
+            copy[i] = (pte_t) private;
+        }
+        else {
+            __atomic_fetch_or(pte, PTE_COW, __ATOMIC_ACQ_REL);
+            add_share(info);
+            copy[i] = (pte_t) frame | PTE_COW;
+        }
+        snapshot->num_pages++;
+    }
+    return 0;
+}
+
+/*
+Copies size bytes starting at va, as it was when the snapshot was taken, into
+val. Runs in a read section like get_value. Returns 0 on success and -1 if
+part of the range was not mapped in the snapshot, in which case nothing is
+copied.
+*/
+int t_snapshot_get(struct vm_snapshot *snapshot, void *va, void *val, int size) {
+    if(size <= 0) {
+        return size < 0 ? -1 : 0;
+    }
+    unsigned long remaining = size;
+    unsigned long first_vpn = (unsigned long) va >> num_offset_bits;
+    unsigned long last_vpn = ((unsigned long) va + remaining - 1) >> num_offset_bits;
+    if(last_vpn >= num_virtual_pages || last_vpn < first_vpn) {
+        return -1;
+    }
+
+    struct vm_thread *thread = get_vm_thread();
+    enter_read_section(thread);
+    for(unsigned long vpn = first_vpn; vpn <= last_vpn; vpn++) {
+        pte_t *pte = walk_page_tables(snapshot->page_directory, (void*) (vpn << num_offset_bits), false, NULL);
+        if(!pte || !*pte) {
+            exit_read_section(thread);
+            return -1;
+        }
+    }
+
+    unsigned long offset = (unsigned long) va & (PGSIZE - 1);
+    while(remaining > 0) {
+        unsigned long bytesToCopy = PGSIZE - offset;
+        if(bytesToCopy > remaining) {
+            bytesToCopy = remaining;
+        }
+        pte_t *pte = walk_page_tables(snapshot->page_directory, va, false, NULL);
+        void *pa = (void*) (*pte & ~PTE_FLAGS);
+        unsigned char saved[PGSIZE];
+        if(*pte & PTE_SWAPPED) {
+            if(load_page(*pte, saved) < 0) {
+                exit_read_section(thread);
+                return -1;
+            }
+            pa = saved;
+        }
+        memcpy(val, pa + offset, bytesToCopy);
+
+        va = (void*) ((unsigned long) va + bytesToCopy);
+        val = (void*) ((unsigned long) val + bytesToCopy);
+        remaining -= bytesToCopy;
+        offset = 0;
+    }
+    exit_read_section(thread);
+    return 0;
+}
+
+/*
+Frees a snapshot, its page tables and every frame only it still maps. Frames
+still shared keep their other mappings. Shares are dropped atomically, so no
+context's lock is needed.
+*/
+void t_snapshot_free(struct vm_snapshot *snapshot) {
+    unsigned long num_directory_entries = 1UL << num_page_directory_bits;
+
+    //Readers of the snapshot must be done with its frames before they are reused
+    synchronize_readers();
+    free_snapshot_table(snapshot->page_directory, VM_LEVELS - 1);
+    free_frames(snapshot->page_directory, (num_directory_entries * sizeof(pde_t) + PGSIZE - 1) / PGSIZE);
+    free(snapshot);
+}
+
+/*
+Releases every entry of a snapshot table at level and the tables below it,
+but not the table itself
+*/
+void free_snapshot_table(pde_t *table, int level) {
+    unsigned long num_entries = 1UL << (level == VM_LEVELS - 1 ? num_page_directory_bits : num_page_table_bits);
+    for(unsigned long i = 0; i < num_entries; i++) {
+        if(!table[i]) {
+            continue;
+        }
+        void *pa = (void*) (table[i] & ~PTE_FLAGS);
+        if(level > 0) {
+            free_snapshot_table(pa, level - 1);
+            free_frames(pa, 1);
+            continue;
+        }
+        if(table[i] & PTE_SWAPPED) {
+            free_stored_page(table[i]);
+        }
+        else if(pa != zero_page && !drop_share(get_frame_info(pa))) {
+            free_frames(pa, 1);
+        }
+    }
+}
+
+/*
+Replaces the frames a new snapshot table at level maps with saved copies,
+from the first entry on, while more than half of memory is shared. Frames
+only the snapshot maps, the copies of pinned pages, are always saved. Runs
+after the grace period that follows cloning, when no one writes the shared
+frames. Returns false once there is nowhere left to save pages.
+*/
+bool spill_snapshot_table(pde_t *table, int level) {
+    unsigned long num_entries = 1UL << (level == VM_LEVELS - 1 ? num_page_directory_bits : num_page_table_bits);
+    for(unsigned long i = 0; i < num_entries; i++) {
+        if(!table[i]) {
+            continue;
+        }
+        void *pa = (void*) (table[i] & ~PTE_FLAGS);
+        if(level > 0) {
+            if(!spill_snapshot_table(pa, level - 1)) {
+                return false;
+            }
+            continue;
+        }
+        if((table[i] & PTE_SWAPPED) || pa == zero_page) {
+            continue;
+        }
+        struct frame_info *info = get_frame_info(pa);
+        if(info->shares && __atomic_load_n(&shared_frames, __ATOMIC_RELAXED) <= num_physical_pages / 2) {
+            continue;
+        }
+        pte_t saved = store_page(pa);
+        if(!saved) {
+            return false;
+        }
+        table[i] = saved;
+        if(!drop_share(info)) {
+            free_frames(pa, 1);
+        }
+    }
+    return true;
+}
+
+/*
+Creates a new, empty address space. Physical memory is set up on first use
+like in t_malloc. Returns NULL if it cannot be set up.
+*/
+struct vm_context *t_vm_create() {
+    struct vm_context *ctx = calloc(1, sizeof(struct vm_context));
+    if(!ctx) {
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    pthread_mutex_lock(&lock);
+    if(!physical_mem) {
+        set_physical_mem();
+    }
+    if(!physical_mem || init_context(ctx) < 0) {
+        pthread_mutex_unlock(&lock);
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx);
+        return NULL;
+    }
+    pthread_mutex_unlock(&lock);
+    return ctx;
+}
+
+/*
+Creates a copy of the address space of ctx. Every page, and every slab
+object, is at the same address in the copy, and the two share their frames
+copy on write. Returns NULL if memory runs out.
+*/
+struct vm_context *t_vm_fork(struct vm_context *ctx) {
+    if(!__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    struct vm_context *child = calloc(1, sizeof(struct vm_context));
+    if(!child) {
+        return NULL;
+    }
+    if(bitmap_init(&child->virtual_bitmap, num_virtual_pages) < 0) {
+        free(child);
+        return NULL;
+    }
+    bitmap_set(&child->virtual_bitmap, 0, 1);
+
+    //The child takes over the tables of a snapshot, which already hold a
+    //share of every frame
+    lock_vm(ctx);
+    struct vm_snapshot *snapshot = snapshot_context(ctx);
+    if(!snapshot) {
+        pthread_mutex_unlock(&ctx->lock);
+        bitmap_destroy(&child->virtual_bitmap);
+        free(child);
+        return NULL;
+    }
+    pthread_mutex_init(&child->lock, NULL);
+
+    //Slab pages were shared with everything else, so only their bookkeeping
+    //is left to duplicate, while it still matches the pages
+    for(int i = 0; i < SLAB_HASH_SIZE; i++) {
+        for(struct slab *slab = ctx->slab_hash[i]; slab; slab = slab->hash_next) {
+            struct slab *copy = malloc(sizeof(struct slab));
+            if(!copy) {
+                pthread_mutex_unlock(&ctx->lock);
+                free_slabs(child);
+                t_snapshot_free(snapshot);
+                pthread_mutex_destroy(&child->lock);
+                bitmap_destroy(&child->virtual_bitmap);
+                free(child);
+                return NULL;
+            }
+            memcpy(copy, slab, sizeof(struct slab));
+            copy->next = copy->prev = NULL;
+            copy->hash_next = child->slab_hash[i];
+            child->slab_hash[i] = copy;
+            if(copy->num_free > 0) {
+                slab_list_push(child, copy);
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    child->page_directory = snapshot->page_directory;
+    free(snapshot);
+
+    unsigned long num_directory_frames = ((1UL << num_page_directory_bits) * sizeof(pde_t) + PGSIZE - 1) / PGSIZE;
+    for(unsigned long i = 0; i < num_directory_frames; i++) {
+        get_frame_info((void*) child->page_directory + i * PGSIZE)->owner = child;
+    }
+    adopt_table(child, child->page_directory, VM_LEVELS - 1, 0);
+
+    pthread_mutex_lock(&lock);
+    child->asid = next_asid++;
+    child->next = vm_contexts;
+    if(vm_contexts) {
+        vm_contexts->prev = child;
+    }
+    vm_contexts = child;
+    pthread_mutex_unlock(&lock);
+    return child;
+}
+
+/*
+Makes ctx the owner of a table at level taken over from a snapshot and of the
+tables below it, marking every page they map as allocated. Frames that only
+the snapshot mapped now point back at the entries of ctx.
+*/
+void adopt_table(struct vm_context *ctx, pde_t *table, int level, unsigned long first_vpn) {
+    unsigned long num_entries = 1UL << (level == VM_LEVELS - 1 ? num_page_directory_bits : num_page_table_bits);
+    for(unsigned long i = 0; i < num_entries; i++) {
+        if(!table[i]) {
+            continue;
+        }
+        unsigned long vpn = first_vpn + (i << (level * num_page_table_bits));
+        void *pa = (void*) (table[i] & ~PTE_FLAGS);
+        if(level > 0) {
+            get_frame_info(pa)->owner = ctx;
+            adopt_table(ctx, pa, level - 1, vpn);
+            continue;
+        }
+        bitmap_set(&ctx->virtual_bitmap, vpn, 1);
+        if(!(table[i] & (PTE_COW | PTE_SWAPPED))) {
+            get_frame_info(pa)->pte = &table[i];
+        }
+    }
+}
+
+/*
+Frees the address space of ctx, its page tables and every frame only it
+maps. The default context cannot be destroyed. No thread may use ctx during
+or after the call, and its pinned views must be unpinned first.
+*/
+void t_vm_destroy(struct vm_context *ctx) {
+    if(!ctx || ctx == &default_context) {
+        return;
+    }
+
+    //Once unlinked, reclaim_frames no longer visits the context
+    pthread_mutex_lock(&lock);
+    if(ctx->prev) {
+        ctx->prev->next = ctx->next;
+    }
+    else {
+        vm_contexts = ctx->next;
+    }
+    if(ctx->next) {
+        ctx->next->prev = ctx->prev;
+    }
+    pthread_mutex_unlock(&lock);
+
+    lock_vm(ctx);
+    tlb_shootdown(ctx);
+    synchronize_readers();
+    unsigned long num_directory_frames = ((1UL << num_page_directory_bits) * sizeof(pde_t) + PGSIZE - 1) / PGSIZE;
+    free_context_tables(ctx->page_directory, VM_LEVELS - 1);
+    free_frames(ctx->page_directory, num_directory_frames);
+    free_slabs(ctx);
+    bitmap_destroy(&ctx->virtual_bitmap);
+    pthread_mutex_unlock(&ctx->lock);
+
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+/*
+Frees the slab bookkeeping of ctx, but not the slab pages
+*/
+void free_slabs(struct vm_context *ctx) {
+    for(int i = 0; i < SLAB_HASH_SIZE; i++) {
+        struct slab *slab = ctx->slab_hash[i];
+        while(slab) {
+            struct slab *next = slab->hash_next;
+            free(slab);
+            slab = next;
         }
+        ctx->slab_hash[i] = NULL;
     }
-    return NULL;
 }
 
+/*
+Releases every entry of a live table at level and the tables below it, but
+not the table itself. Lock of the owning context must be held.
+*/
+void free_context_tables(pde_t *table, int level) {
+    unsigned long num_entries = 1UL << (level == VM_LEVELS - 1 ? num_page_directory_bits : num_page_table_bits);
+    for(unsigned long i = 0; i < num_entries; i++) {
+        if(!table[i]) {
+            continue;
+        }
+        void *pa = (void*) (table[i] & ~PTE_FLAGS);
+        if(level > 0) {
+            free_context_tables(pa, level - 1);
+            get_frame_info(pa)->owner = NULL;
+            free_frames(pa, 1);
+            continue;
+        }
+        release_entry(table[i]);
+    }
+}
 
-/* Function responsible for allocating pages
-and used by the benchmark
+/*
+This function receives two matrices mat1 and mat2 as an argument with size
+argument representing the number of rows and columns. After performing matrix
+multiplication, copy the result to answer.
 */
-void *t_malloc(unsigned int num_bytes) {
+void mat_mult(void *mat1, void *mat2, int size, void *answer) {
 
-    /* 
-     * HINT: If the physical memory is not yet initialized, then allocate and initialize.
+    /* Hint: You will index as [i * size + j] where  "i, j" are the indices of the
+     * matrix accessed. Similar to the code in test.c, you will use get_value() to
+     * load each element and perform multiplication. Take a look at test.c! In addition to 
+     * getting the values from two matrices, you will perform multiplication and 
+     * store the result to the "answer array"
      */
+    mat_mult_ex(mat1, mat2, answer, size, size, size, MAT_INT);
+}
 
-   /* 
-    * HINT: If the page directory is not initialized, then initialize the
-    * page directory. Next, using get_next_avail(), check if there are free pages. If
-    * free pages are available, set the bitmaps and map a new page. Note, you will 
-    * have to mark which physical pages are used. 
-    */
+/*
+Copies a rows x cols tile whose top left element is (row, col) of a matrix
+with ld columns between virtual memory and a packed MAT_TILE x MAT_TILE host
+tile. Each row of the tile is a contiguous run of virtual memory, so it costs
+one translation per page it spans. Unused parts of a host tile that is read
+into are zeroed so the kernels can always work on whole tiles.
+*/
+static int mat_copy_tile(struct vm_context *ctx, void *mat, int ld, int row, int col, int rows, int cols, void *tile, bool write) {
+    struct vm_thread *thread = get_vm_thread();
+    struct page_cache cache = { .vpn = BITMAP_NONE };
+    int ret = 0;
 
-    //Initialize physical memory is it hasn't been
-    pthread_mutex_lock(&lock);
-    if(!physical_mem) {
-        set_physical_mem();
-        
+    if(!write) {
+        memset(tile, 0, MAT_TILE * MAT_TILE * MAT_ELEM_SIZE);
     }
-    
 
-    unsigned int num_pages = (num_bytes + PGSIZE - 1) / PGSIZE;
-    
-    //Check if there are available pages
-    void* va = get_next_avail(num_pages);
-    if(!va) {
-        pthread_mutex_unlock(&lock);
-        return NULL;
+    enter_read_section(thread);
+    for(int r = 0; r < rows && ret == 0; r++) {
+        void *va = mat + ((unsigned long) (row + r) * ld + col) * MAT_ELEM_SIZE;
+        void *tile_row = tile + (unsigned long) r * MAT_TILE * MAT_ELEM_SIZE;
+        ret = copy_range(ctx, &cache, va, tile_row, (unsigned long) cols * MAT_ELEM_SIZE, write);
+        while(ret <= VM_NO_MEMORY && resolve_in_read_section(ctx, thread, &cache, ret)) {
+            ret = copy_range(ctx, &cache, va, tile_row, (unsigned long) cols * MAT_ELEM_SIZE, write);
+        }
     }
+    exit_read_section(thread);
+    return ret < 0 ? -1 : 0;
+}
 
-    void* pa = get_next_avail_physical(num_pages);
-    if(!pa) {
-        pthread_mutex_unlock(&lock);
-        return NULL;
+/*
+Multiplies the first rows rows of packed tile a by packed tile b, over depth
+columns of a, and adds the result to packed tile c. Each row of c is updated
+MAT_VECTOR_LANES elements at a time.
+*/
+static void mat_kernel_int(const int *a, const int *b, int *c, int rows, int depth) {
+    for(int i = 0; i < rows; i++) {
+        mat_vec_int *c_row = (mat_vec_int*) (c + i * MAT_TILE);
+        for(int k = 0; k < depth; k++) {
+            int a_val = a[i * MAT_TILE + k];
+            const mat_vec_int *b_row = (const mat_vec_int*) (b + k * MAT_TILE);
+            for(int j = 0; j < MAT_TILE / MAT_VECTOR_LANES; j++) {
+                c_row[j] += a_val * b_row[j];
+            }
+        }
     }
+}
 
-    for (int i = 0; i < num_pages; i++) {
-        unsigned long nextFreePage = next_free_page(physical_bitmap);
-        set_bit(physical_bitmap, nextFreePage, 1);
-        pa = get_physical_addr_from_bit(nextFreePage);
-        page_map(page_directory, va + i * PGSIZE, pa);
+static void mat_kernel_float(const float *a, const float *b, float *c, int rows, int depth) {
+    for(int i = 0; i < rows; i++) {
+        mat_vec_float *c_row = (mat_vec_float*) (c + i * MAT_TILE);
+        for(int k = 0; k < depth; k++) {
+            float a_val = a[i * MAT_TILE + k];
+            const mat_vec_float *b_row = (const mat_vec_float*) (b + k * MAT_TILE);
+            for(int j = 0; j < MAT_TILE / MAT_VECTOR_LANES; j++) {
+                c_row[j] += a_val * b_row[j];
+            }
+        }
     }
-    pthread_mutex_unlock(&lock);
-    return va;
 }
 
-/* Responsible for releasing one or more memory pages using virtual address (va)
+/*
+Multiplies the m x k matrix mat1 by the k x n matrix mat2 into the m x n
+matrix answer, all row major, with elements of the given type (MAT_INT or
+MAT_FLOAT). The product is computed one MAT_TILE x MAT_TILE tile of answer at
+a time: matching tiles of both operands are copied into host memory a page
+span at a time, multiplied with the vector kernel while they are cache
+resident, and the finished tile is written back once.
+Returns 0 on success and -1 if an operand is not fully mapped.
 */
-void t_free(void *va, int size) {
+int mat_mult_ex(void *mat1, void *mat2, void *answer, int m, int k, int n, int type) {
+    return t_vm_mat_mult_ex(&default_context, mat1, mat2, answer, m, k, n, type);
+}
 
-    /* Part 1: Free the page table entries starting from this virtual address
-     * (va). Also mark the pages free in the bitmap. Perform free only if the 
-     * memory from "va" to va+size is valid.
-     *
-     * Part 2: Also, remove the translation from the TLB
-     */
+/*
+mat_mult_ex on matrices in the address space of ctx
+*/
+int t_vm_mat_mult_ex(struct vm_context *ctx, void *mat1, void *mat2, void *answer, int m, int k, int n, int type) {
+    if(m <= 0 || k <= 0 || n <= 0 || (type != MAT_INT && type != MAT_FLOAT)) {
+        return -1;
+    }
+    if(!__atomic_load_n(&vm_initialized, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
 
-    //Number of pages to free
-    pthread_mutex_lock(&lock);
-    unsigned int num_pages = (size + PGSIZE - 1) / PGSIZE;
+    void *a_tile, *b_tile, *c_tile;
+    unsigned long tile_bytes = MAT_TILE * MAT_TILE * MAT_ELEM_SIZE;
+    if(posix_memalign(&a_tile, MAT_VECTOR_BYTES, tile_bytes) ||
+       posix_memalign(&b_tile, MAT_VECTOR_BYTES, tile_bytes) ||
+       posix_memalign(&c_tile, MAT_VECTOR_BYTES, tile_bytes)) {
+        return -1;
+    }
 
-    //Check if num_pages pages are allocated in the virtual bitmap
-    unsigned long vpn = (unsigned long) va >> num_offset_bits;
-    for (int i = 0; i < num_pages; i++) {
-        if(!get_bit(virtual_bitmap, vpn)) {
-            pthread_mutex_unlock(&lock);
-            return;
+    int ret = 0;
+    for(int i = 0; i < m && ret == 0; i += MAT_TILE) {
+        int rows = (m - i < MAT_TILE) ? m - i : MAT_TILE;
+        for(int j = 0; j < n && ret == 0; j += MAT_TILE) {
+            int cols = (n - j < MAT_TILE) ? n - j : MAT_TILE;
+            memset(c_tile, 0, tile_bytes);
+
+            for(int l = 0; l < k && ret == 0; l += MAT_TILE) {
+                int depth = (k - l < MAT_TILE) ? k - l : MAT_TILE;
+                ret = mat_copy_tile(ctx, mat1, k, i, l, rows, depth, a_tile, false);
+                if(ret == 0) {
+                    ret = mat_copy_tile(ctx, mat2, n, l, j, depth, cols, b_tile, false);
+                }
+                if(ret == 0 && type == MAT_INT) {
+                    mat_kernel_int(a_tile, b_tile, c_tile, rows, depth);
+                }
+                else if(ret == 0) {
+                    mat_kernel_float(a_tile, b_tile, c_tile, rows, depth);
+                }
+            }
+
+            if(ret == 0) {
+                ret = mat_copy_tile(ctx, answer, n, i, j, rows, cols, c_tile, true);
+            }
         }
-        vpn++;
     }
-    
-    for (int i = 0; i < num_pages; i++) {
-        unsigned long vpn = (unsigned int) va >> num_offset_bits;
 
-        //Get page table entry
-        pte_t *pte = translate(page_directory, va);
-        unsigned long bitPos = get_bit_position_from_pointer((void*) *pte);
+    free(a_tile);
+    free(b_tile);
+    free(c_tile);
+    return ret;
+}
 
-        //Free physical page and update physical bitmap
-        set_bit(physical_bitmap, bitPos, 0);
-        *pte = 0;
+void set_bit(unsigned char* bitmap, unsigned long index, unsigned int value) {
+    unsigned int byte_index = index / 8;
+    unsigned int pos = index % 8;
 
-        //Update virtual bitmap
-        set_bit(virtual_bitmap, vpn, 0);
+    if (value) {
+        bitmap[byte_index] |= (1 << pos);
+    } else {
+        bitmap[byte_index] &= ~(1 << pos);
+    }
+}
 
-        unsigned long index = get_tlb_index(va);
-        tlb_arr[index].va = NULL;
-        tlb_arr[index].pa = NULL;
+int get_bit(unsigned char* bitmap, unsigned long index) {
+    unsigned int byte_index = index / 8;
+    unsigned int pos = index % 8;
+    return (bitmap[byte_index] & (1 << pos)) != 0;
+}
 
-        //Set virtual address to the next page
-        va = (void*) ((unsigned long) va + PGSIZE);
-    }
-    pthread_mutex_unlock(&lock);
+void* get_physical_addr_from_bit(unsigned long pageNumInBitmap) {
+    return (void*) ((pageNumInBitmap * PGSIZE) + physical_mem);
 }
 
+unsigned long get_bit_position_from_pointer(void* pa) {
+    return (unsigned long) (pa - physical_mem) / PGSIZE;
+}
 
-/* The function copies data pointed by "val" to physical
- * memory pages using virtual address (va)
- * The function returns 0 if the put is successfull and -1 otherwise.
+struct frame_info *get_frame_info(void* pa) {
+    return &frame_table[get_bit_position_from_pointer(pa)];
+}
+
+/*
+Sets up the buddy allocator over num_frames frames, all of them free. Returns
+-1, with nothing allocated, if its lists cannot be allocated.
 */
-int put_value(void *va, void *val, int size) {
+int buddy_init(struct buddy* buddy, unsigned long num_frames) {
+    buddy->num_frames = num_frames;
+    buddy->free_count = 0;
+    memset(buddy->free_blocks, 0, sizeof(buddy->free_blocks));
+    buddy->next = malloc(num_frames * sizeof(unsigned int));
+    buddy->prev = malloc(num_frames * sizeof(unsigned int));
+    buddy->order = malloc(num_frames * sizeof(unsigned char));
+    if(!buddy->next || !buddy->prev || !buddy->order) {
+        buddy_destroy(buddy);
+        return -1;
+    }
+    memset(buddy->order, BUDDY_NOT_FREE, num_frames);
+    for(int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        buddy->free_head[order] = BUDDY_NONE;
+    }
+    buddy_free_range(buddy, 0, num_frames);
+    return 0;
+}
 
-    /* HINT: Using the virtual address and translate(), find the physical page. Copy
-     * the contents of "val" to a physical page. NOTE: The "size" value can be larger 
-     * than one page. Therefore, you may have to find multiple pages using translate()
-     * function.
-     */
-    
-    //Number of pages needed
-    pthread_mutex_lock(&lock);
-    unsigned int num_pages = (size + PGSIZE - 1) / PGSIZE;
-    unsigned long bytesRemaining = size;
-    unsigned long bytesToWrite;
-    
-    //Check if num_pages pages are allocated in the virtual bitmap
-    unsigned long vpn = (unsigned long) va >> num_offset_bits;
-    for (int i = 0; i < num_pages; i++) {
-        if(!get_bit(virtual_bitmap, vpn)) {
-            pthread_mutex_unlock(&lock);
-            return -1;
-        }
-        vpn++;
+/*
+Frees the lists of a buddy allocator
+*/
+void buddy_destroy(struct buddy* buddy) {
+    free(buddy->next);
+    free(buddy->prev);
+    free(buddy->order);
+    buddy->next = NULL;
+    buddy->prev = NULL;
+    buddy->order = NULL;
+}
+
+static void buddy_list_push(struct buddy* buddy, unsigned long frame, unsigned int order) {
+    buddy->order[frame] = order;
+    buddy->free_blocks[order]++;
+    buddy->prev[frame] = BUDDY_NONE;
+    buddy->next[frame] = buddy->free_head[order];
+    if(buddy->next[frame] != BUDDY_NONE) {
+        buddy->prev[buddy->next[frame]] = frame;
     }
+    buddy->free_head[order] = frame;
+}
 
-    for (int i = 0; i < num_pages; i++) {
-        unsigned int vpn = (unsigned int) va >> num_offset_bits;
+static void buddy_list_remove(struct buddy* buddy, unsigned long frame) {
+    unsigned int order = buddy->order[frame];
+    buddy->free_blocks[order]--;
+    if(buddy->prev[frame] != BUDDY_NONE) {
+        buddy->next[buddy->prev[frame]] = buddy->next[frame];
+    }
+    else {
+        buddy->free_head[order] = buddy->next[frame];
+    }
+    if(buddy->next[frame] != BUDDY_NONE) {
+        buddy->prev[buddy->next[frame]] = buddy->prev[frame];
+    }
+    buddy->order[frame] = BUDDY_NOT_FREE;
+}
 
-        if(bytesRemaining > PGSIZE) {
-            bytesToWrite = PGSIZE;
-            bytesRemaining -= PGSIZE;
+/*
+Frees the block of 2^order frames starting at frame, merging it with its
+buddy for as long as the buddy is also a free block of the same order
+*/
+static void buddy_free_block(struct buddy* buddy, unsigned long frame, unsigned int order) {
+    __atomic_fetch_add(&buddy->free_count, 1UL << order, __ATOMIC_RELAXED);
+    while(order < BUDDY_MAX_ORDER) {
+        unsigned long buddy_frame = frame ^ (1UL << order);
+        if(buddy_frame + (1UL << order) > buddy->num_frames || buddy->order[buddy_frame] != order) {
+            break;
         }
-        else {
-            bytesToWrite = bytesRemaining;
-            bytesRemaining = 0;
+        buddy_list_remove(buddy, buddy_frame);
+        if(buddy_frame < frame) {
+            frame = buddy_frame;
         }
+        order++;
+    }
+    buddy_list_push(buddy, frame, order);
+}
 
-        //Get physical page number and copy bytes of val to it
-        pte_t *pte = translate(page_directory, va);
-        memcpy((void*) *pte, val + i * PGSIZE, bytesToWrite);
-
-        //Set virtual address to the next page
-        va = (void*) ((unsigned long) va + PGSIZE);
+/*
+Frees an arbitrary run of frames by splitting it into the largest aligned
+blocks that fit
+*/
+void buddy_free_range(struct buddy* buddy, unsigned long frame, unsigned long num_frames) {
+    unsigned long end = frame + num_frames;
+    while(frame < end) {
+        unsigned int order = 0;
+        while(order < BUDDY_MAX_ORDER && !(frame & (1UL << order)) && frame + (2UL << order) <= end) {
+            order++;
+        }
+        buddy_free_block(buddy, frame, order);
+        frame += 1UL << order;
     }
-    pthread_mutex_unlock(&lock);
-    return 0;
+}
 
-    /*return -1 if put_value failed and 0 if put is successfull*/
+/*
+Allocates num_frames contiguous frames. The smallest free block that can hold
+them is split down to size and any tail past num_frames is freed again.
+Returns the first frame, or BUDDY_NONE if no free block is large enough.
+*/
+unsigned long buddy_alloc(struct buddy* buddy, unsigned long num_frames) {
+    unsigned int order = 0;
+    while((1UL << order) < num_frames) {
+        order++;
+    }
+    if(order > BUDDY_MAX_ORDER) {
+        return BUDDY_NONE;
+    }
 
-}
+    unsigned int block_order = order;
+    while(block_order <= BUDDY_MAX_ORDER && buddy->free_head[block_order] == BUDDY_NONE) {
+        block_order++;
+    }
+    if(block_order > BUDDY_MAX_ORDER) {
+        return BUDDY_NONE;
+    }
 
+    unsigned long frame = buddy->free_head[block_order];
+    buddy_list_remove(buddy, frame);
+    __atomic_fetch_sub(&buddy->free_count, 1UL << block_order, __ATOMIC_RELAXED);
 
-/*Given a virtual address, this function copies the contents of the page to val*/
-void get_value(void *va, void *val, int size) {
+    //Split off the upper halves until the block is the requested order
+    while(block_order > order) {
+        block_order--;
+        buddy_list_push(buddy, frame + (1UL << block_order), block_order);
+        __atomic_fetch_add(&buddy->free_count, 1UL << block_order, __ATOMIC_RELAXED);
+    }
 
-    /* HINT: put the values pointed to by "va" inside the physical memory at given
-    * "val" address. Assume you can access "val" directly by derefencing them.
-    */
+    if(num_frames < (1UL << order)) {
+        buddy_free_range(buddy, frame + num_frames, (1UL << order) - num_frames);
+    }
+    return frame;
+}
 
-    //Number of pages needed
-    pthread_mutex_lock(&lock);
+/*
+Allocates num_pages physically contiguous frames and returns the address of
+the first one, or NULL if no run that large is free
+*/
+void *alloc_frames(unsigned int num_pages) {
+    pthread_mutex_lock(&frame_lock);
+    unsigned long frame = buddy_alloc(&physical_frames, num_pages);
+    pthread_mutex_unlock(&frame_lock);
+    wake_swap_daemon();
+    if(frame == BUDDY_NONE) {
+        return NULL;
+    }
+    return get_physical_addr_from_bit(frame);
+}
 
-    unsigned int num_pages = (size + PGSIZE - 1) / PGSIZE;
-    unsigned long bytesRemaining = size;
-    unsigned long bytesToGet;
+/*
+Frees num_pages frames starting at pa. Memory of free blocks of at least
+release_order is given back to the OS and reads as zeros when next touched.
+*/
+void free_frames(void *pa, unsigned int num_pages) {
+    pthread_mutex_lock(&frame_lock);
+    unsigned long frame = get_bit_position_from_pointer(pa);
+    buddy_free_range(&physical_frames, frame, num_pages);
+    release_free_blocks(frame, num_pages);
+    pthread_mutex_unlock(&frame_lock);
+}
 
-    //Check if num_pages pages are allocated in the virtual bitmap
-    unsigned long vpn = (unsigned long) va >> num_offset_bits;
-    for (int i = 0; i < num_pages; i++) {
-        if(!get_bit(virtual_bitmap, vpn)) {
-            pthread_mutex_unlock(&lock);
-            return;
+/*
+Gives back the memory of every aligned block of 2^release_order frames that
+overlaps the frames just freed and is now entirely free. Releasing single
+frames would cost a system call per free and split huge pages on the host,
+so only whole blocks are released. The frame lock must be held, so the frames
+cannot be handed out, and written, before they are released.
+*/
+void release_free_blocks(unsigned long frame, unsigned long num_frames) {
+    unsigned long block_frames = 1UL << release_order;
+    unsigned long first = frame & ~(block_frames - 1);
+    for(unsigned long block = first; block < frame + num_frames; block += block_frames) {
+        for(unsigned int order = release_order; order <= BUDDY_MAX_ORDER; order++) {
+            unsigned long start = block & ~((1UL << order) - 1);
+            if(start + (1UL << order) <= physical_frames.num_frames && physical_frames.order[start] == order) {
+                madvise(get_physical_addr_from_bit(block), block_frames * PGSIZE, MADV_DONTNEED);
+                break;
+            }
         }
-        vpn++;
     }
+}
+
+/*
+Sets up a bitmap of num_bits bits with a summary level above it for every
+level that spans more than one word. A set bit in a summary level means the
+word below it is full, so searches can skip it without looking at it.
+Returns -1, with nothing mapped, if a level cannot be mapped.
+*/
+int bitmap_init(struct bitmap* bitmap, unsigned long num_bits) {
+    memset(bitmap, 0, sizeof(struct bitmap));
+    bitmap->num_bits = num_bits;
 
-    for (int i = 0; i < num_pages; i++) {
-        unsigned int vpn = (unsigned int) va >> num_offset_bits;
+    unsigned long level_bits = num_bits;
+    while(bitmap->num_levels < BITMAP_MAX_LEVELS) {
+        unsigned long num_words = (level_bits + 63) / 64;
+        int level = bitmap->num_levels++;
+        //Levels are reserved rather than committed, so a sparse 48 bit address
+        //space only costs the words that are actually touched
+        bitmap->levels[level] = mmap(NULL, num_words * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        bitmap->level_bits[level] = level_bits;
+        if(bitmap->levels[level] == MAP_FAILED) {
+            bitmap->num_levels--;
+            bitmap_destroy(bitmap);
+            return -1;
+        }
 
-        if(bytesRemaining > PGSIZE) {
-            bytesToGet = PGSIZE;
-            bytesRemaining -= PGSIZE;
+        //Padding bits past the end are marked used so they are never handed out
+        if(level_bits % 64) {
+            bitmap->levels[level][num_words - 1] = ~0ULL << (level_bits % 64);
         }
-        else {
-            bytesToGet = bytesRemaining;
-            bytesRemaining = 0;
+        if(num_words == 1) {
+            break;
         }
+        level_bits = num_words;
+    }
+    return 0;
+}
+
+/*
+Unmaps the levels of a bitmap set up by bitmap_init
+*/
+void bitmap_destroy(struct bitmap* bitmap) {
+    for(unsigned int level = 0; level < bitmap->num_levels; level++) {
+        munmap(bitmap->levels[level], (bitmap->level_bits[level] + 63) / 64 * sizeof(uint64_t));
+    }
+    memset(bitmap, 0, sizeof(struct bitmap));
+}
 
-        //Get physical page number and copy bytes of val to it
-        pte_t *pte = translate(page_directory, va);
-        memcpy(val + i * PGSIZE, (void*) *pte, bytesToGet);
+/*
+Sets or clears a bit at one level and propagates a word becoming full, or
+no longer full, into the summary level above it
+*/
+static void bitmap_update(struct bitmap* bitmap, unsigned int level, unsigned long index, unsigned int value) {
+    unsigned long word_index = index / 64;
+    uint64_t old_word = bitmap->levels[level][word_index];
+    uint64_t new_word;
 
-        //Set virtual address to the next page
-        va = (void*) ((unsigned long) va + PGSIZE);
+    if(value) {
+        new_word = old_word | (1ULL << (index % 64));
+    } else {
+        new_word = old_word & ~(1ULL << (index % 64));
     }
-    pthread_mutex_unlock(&lock);
+    __atomic_store_n(&bitmap->levels[level][word_index], new_word, __ATOMIC_RELAXED);
 
+    if(level + 1 < bitmap->num_levels) {
+        if(new_word == ~0ULL && old_word != ~0ULL) {
+            bitmap_update(bitmap, level + 1, word_index, 1);
+        }
+        else if(old_word == ~0ULL && new_word != ~0ULL) {
+            bitmap_update(bitmap, level + 1, word_index, 0);
+        }
+    }
 }
 
+void bitmap_set(struct bitmap* bitmap, unsigned long index, unsigned int value) {
+    if(bitmap_get(bitmap, index) != (value != 0)) {
+        __atomic_store_n(&bitmap->num_set, value ? bitmap->num_set + 1 : bitmap->num_set - 1, __ATOMIC_RELAXED);
+    }
+    bitmap_update(bitmap, 0, index, value);
+
+    //Nothing below the hint is free, so a freed bit below it becomes the new hint
+    if(!value && index < bitmap->hint) {
+        bitmap->hint = index;
+    }
+}
 
+int bitmap_get(struct bitmap* bitmap, unsigned long index) {
+    return (__atomic_load_n(&bitmap->levels[0][index / 64], __ATOMIC_RELAXED) >> (index % 64)) & 1;
+}
 
 /*
-This function receives two matrices mat1 and mat2 as an argument with size
-argument representing the number of rows and columns. After performing matrix
-multiplication, copy the result to answer.
+Returns the index of the first clear bit at or after index in a level, using
+the level above to jump over full words
 */
-void mat_mult(void *mat1, void *mat2, int size, void *answer) {
+static unsigned long bitmap_find_clear(struct bitmap* bitmap, unsigned int level, unsigned long index) {
+    while(index < bitmap->level_bits[level]) {
+        unsigned long word_index = index / 64;
+        uint64_t free_bits = ~bitmap->levels[level][word_index] & (~0ULL << (index % 64));
+        if(free_bits) {
+            index = word_index * 64 + __builtin_ctzll(free_bits);
+            return index < bitmap->level_bits[level] ? index : BITMAP_NONE;
+        }
 
-    /* Hint: You will index as [i * size + j] where  "i, j" are the indices of the
-     * matrix accessed. Similar to the code in test.c, you will use get_value() to
-     * load each element and perform multiplication. Take a look at test.c! In addition to 
-     * getting the values from two matrices, you will perform multiplication and 
-     * store the result to the "answer array"
-     */
-    int x, y, val_size = sizeof(int);
-    int i, j, k;
-    for (i = 0; i < size; i++) {
-        for(j = 0; j < size; j++) {
-            unsigned int a, b, c = 0;
-            for (k = 0; k < size; k++) {
-                int address_a = (unsigned int)mat1 + ((i * size * sizeof(int))) + (k * sizeof(int));
-                int address_b = (unsigned int)mat2 + ((k * size * sizeof(int))) + (j * sizeof(int));
-                get_value( (void *)address_a, &a, sizeof(int));
-                get_value( (void *)address_b, &b, sizeof(int));
-                // printf("Values at the index: %d, %d, %d, %d, %d\n", 
-                //     a, b, size, (i * size + k), (k * size + j));
-                c += (a * b);
+        //Rest of this word is full, ask the summary for the next word with room
+        if(level + 1 < bitmap->num_levels) {
+            word_index = bitmap_find_clear(bitmap, level + 1, word_index + 1);
+            if(word_index == BITMAP_NONE) {
+                return BITMAP_NONE;
             }
-            int address_c = (unsigned int)answer + ((i * size * sizeof(int))) + (j * sizeof(int));
-            // printf("This is the c: %d, address: %x!\n", c, address_c);
-            put_value((void *)address_c, (void *)&c, sizeof(int));
+            index = word_index * 64;
+        }
+        else {
+            index = (word_index + 1) * 64;
         }
     }
+    return BITMAP_NONE;
 }
 
-void set_bit(unsigned char* bitmap, unsigned long index, unsigned int value) {
-    unsigned int byte_index = index / 8;
-    unsigned int pos = index % 8;
-
-    if (value) {
-        bitmap[byte_index] |= (1 << pos);
-    } else {
-        bitmap[byte_index] &= ~(1 << pos);
+/*
+Returns the index of the first set bit in [index, limit), or limit if every
+bit in that range is clear
+*/
+static unsigned long bitmap_find_set(struct bitmap* bitmap, unsigned long index, unsigned long limit) {
+    while(index < limit) {
+        uint64_t used_bits = bitmap->levels[0][index / 64] >> (index % 64);
+        if(used_bits) {
+            index += __builtin_ctzll(used_bits);
+            return index < limit ? index : limit;
+        }
+        index = (index / 64 + 1) * 64;
     }
+    return limit;
 }
 
-int get_bit(unsigned char* bitmap, unsigned long index) {
-    unsigned int byte_index = index / 8;
-    unsigned int pos = index % 8;
-    return (bitmap[byte_index] & (1 << pos)) != 0;
+/*
+Returns true if the num_bits bits starting at index are all clear
+*/
+bool bitmap_range_clear(struct bitmap* bitmap, unsigned long index, unsigned long num_bits) {
+    return bitmap_find_set(bitmap, index, index + num_bits) == index + num_bits;
 }
 
-void* get_physical_addr_from_bit(unsigned long pageNumInBitmap) {
-    return (void*) ((pageNumInBitmap * PGSIZE) + physical_mem);
+/*
+Returns the start of the first run of num_bits clear bits, or BITMAP_NONE.
+The search starts at the hint, below which every bit is known to be set.
+*/
+unsigned long bitmap_find_free_run(struct bitmap* bitmap, unsigned long num_bits) {
+    return bitmap_find_aligned_run(bitmap, num_bits, 1);
 }
 
-unsigned long get_bit_position_from_pointer(void* pa) {
-    return (unsigned long) (pa - physical_mem) / PGSIZE;
-}
+/*
+Returns the start of the first run of num_bits clear bits that starts on a
+multiple of align, which must be a power of two, or BITMAP_NONE
+*/
+unsigned long bitmap_find_aligned_run(struct bitmap* bitmap, unsigned long num_bits, unsigned long align) {
+    if(num_bits == 0) {
+        return BITMAP_NONE;
+    }
 
-void *get_next_avail_physical(int num_pages) {
- 
-    //Use physical address bitmap to find the next free page
-    unsigned long start_page = 0;
-    unsigned int num_free_pages = 0;
-    for(int i = 0; i < num_physical_pages; i++) {
-        if(!get_bit(physical_bitmap, i)) {
-            if(num_free_pages == 0) {
-                start_page = i;
-            }
-            num_free_pages++;
-            if(num_free_pages == num_pages) {
-                return (void*) (get_physical_addr_from_bit(start_page));
-            }
+    unsigned long start = bitmap_find_clear(bitmap, 0, bitmap->hint);
+    if(start == BITMAP_NONE) {
+        bitmap->hint = bitmap->num_bits;
+        return BITMAP_NONE;
+    }
+    bitmap->hint = start;
+
+    while(start != BITMAP_NONE) {
+        start = (start + align - 1) & ~(align - 1);
+        if(start + num_bits > bitmap->num_bits) {
+            break;
         }
-        else {
-            num_free_pages = 0;
+        unsigned long end = bitmap_find_set(bitmap, start, start + num_bits);
+        if(end == start + num_bits) {
+            return start;
         }
+        start = bitmap_find_clear(bitmap, 0, end);
     }
-    return NULL;
-}
\ No newline at end of file
+    return BITMAP_NONE;
+}
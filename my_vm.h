@@ -8,63 +8,582 @@
 #include <math.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
 
-//Assume the address space is 32 bits, so the max memory size is 4GB
+//The address space is VM_VA_BITS wide and translated by VM_LEVELS levels of
+//page tables. 64 bit builds default to a 48 bit, 4 level space and 32 bit
+//builds to a 32 bit, 2 level one; either can be set with -D.
 //Page size is 4KB
 
 //Add any important includes here which you may need
 
 #define PGSIZE 4096
 
+#ifndef VM_VA_BITS
+#if UINTPTR_MAX > 0xffffffffUL
+#define VM_VA_BITS 48
+#else
+#define VM_VA_BITS 32
+#endif
+#endif
+
+#ifndef VM_LEVELS
+#if VM_VA_BITS > 32
+#define VM_LEVELS 4
+#else
+#define VM_LEVELS 2
+#endif
+#endif
+
+#if VM_LEVELS < 2
+#error "VM_LEVELS must be at least 2"
+#endif
+
 // Maximum size of virtual memory
-#define MAX_MEMSIZE 4ULL*1024*1024*1024
+#define MAX_MEMSIZE (1ULL << VM_VA_BITS)
 
 // Size of "physcial memory"
 #define MEMSIZE 1024*1024*1024
 
+//Transparent huge page size of the host, used when physical memory asks for them
+#define HUGEPAGE_SIZE (2*1024*1024)
+#define HUGEPAGE_FRAMES (HUGEPAGE_SIZE / PGSIZE)
+#define HUGEPAGE_ORDER 9
+
+//Smallest free buddy block, as an order, whose memory is given back to the OS
+#define RELEASE_ORDER 4
+
 // Represents a page table entry
 typedef unsigned long pte_t;
 
 // Represents a page directory entry
 typedef unsigned long pde_t;
 
+//Frames are page aligned, so the low bits of a page table entry hold flags.
+//A swapped out page keeps its swap slot in place of the frame address, or
+//with PTE_COMPRESSED the first chunk of its copy in the compressed pool.
+#define PTE_SWAPPED 0x1
+#define PTE_SWAPPING 0x2
+#define PTE_ACCESSED 0x4
+#define PTE_LARGE 0x8
+#define PTE_COW 0x10
+#define PTE_COMPRESSED 0x20
+#define PTE_NOT_PRESENT (PTE_SWAPPED | PTE_SWAPPING)
+#define PTE_FLAGS ((pte_t) PGSIZE - 1)
+
+//A large directory entry maps its whole region to one contiguous block of
+//frames. It still points at its page table, whose entries stay filled in and
+//carry PTE_LARGE, so single pages of the region translate as before.
+#define PDE_LARGE 0x1
+
+//Returned inside the library when a page cannot be faulted in for lack of
+//frames, or written because its frame is shared copy on write. Both are
+//resolved outside the read section and the copy retried. A page whose saved
+//copy cannot be read back fails the access at once.
+#define VM_NO_MEMORY -2
+#define VM_COPY_ON_WRITE -3
+#define VM_IO_ERROR -4
+
+//Most pages swapped out by one pass of the swap daemon
+#define SWAP_BATCH 64
+
+//The compressed pool is carved into ZPOOL_CHUNK byte chunks. A page is kept
+//there only if it compresses to at most ZPOOL_MAX_SIZE bytes, otherwise it
+//goes to the swap file, if any, or stays in memory.
+#define ZPOOL_CHUNK 64
+#define ZPOOL_MAX_SIZE (PGSIZE * 3 / 4)
+#define ZPOOL_HASH_BITS 10
+
+//Levels of summary words kept above a bitmap, enough for 64^6 bits
+#define BITMAP_MAX_LEVELS 6
+#define BITMAP_NONE (~0UL)
+
+//Structure to represent a bitmap with summary levels. Level 0 holds one bit
+//per page and each level above holds one bit per full word of the level below.
+typedef struct bitmap {
+    uint64_t *levels[BITMAP_MAX_LEVELS];
+    unsigned long level_bits[BITMAP_MAX_LEVELS];
+    unsigned int num_levels;
+    unsigned long num_bits;
+    unsigned long num_set;
+    unsigned long hint;
+}bitmap;
+
+//Largest buddy block is 2^BUDDY_MAX_ORDER frames
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_NONE (~0U)
+#define BUDDY_NOT_FREE 0xff
+
+//Every level below the top is one page of PGSIZE / sizeof(pte_t) entries and
+//the page directory takes the virtual page number bits left over. It comes
+//from the buddy allocator in one block, so it may span at most
+//2^BUDDY_MAX_ORDER frames.
+#if UINTPTR_MAX > 0xffffffffUL
+#define VM_TABLE_BITS 9
+#else
+#define VM_TABLE_BITS 10
+#endif
+#define VM_DIRECTORY_BITS (VM_VA_BITS - 12 - (VM_LEVELS - 1) * VM_TABLE_BITS)
+
+#if VM_VA_BITS > 63
+#error "VM_VA_BITS must be at most 63"
+#endif
+#if VM_DIRECTORY_BITS < 1
+#error "VM_VA_BITS is too small for VM_LEVELS levels of page tables"
+#endif
+#if VM_DIRECTORY_BITS > VM_TABLE_BITS + BUDDY_MAX_ORDER
+#error "The page directory is larger than a buddy block, raise VM_LEVELS or lower VM_VA_BITS"
+#endif
+
+//Structure to represent the buddy allocator for physical frames. Free blocks
+//sit on one list per order, linked through per-frame next/prev indices, and
+//order[] holds the order of the free block starting at a frame. free_count is
+//updated atomically so the swap daemon can read it without the frame lock.
+typedef struct buddy {
+    unsigned long num_frames;
+    unsigned long free_count;
+    unsigned int free_head[BUDDY_MAX_ORDER + 1];
+    unsigned long free_blocks[BUDDY_MAX_ORDER + 1];
+    unsigned int *next;
+    unsigned int *prev;
+    unsigned char *order;
+}buddy;
+
+//Default TLB geometry, can be changed with set_tlb_config before first use
 #define TLB_ENTRIES 512
+#define TLB_WAYS 4
+
+//TLB replacement policies
+#define TLB_POLICY_LRU 0
+#define TLB_POLICY_CLOCK 1
+
+//Most translations the prefetcher fills ahead of a stream, set with
+//set_tlb_prefetch; 0, the default, turns it off
+#define TLB_PREFETCH_MAX_DEPTH 16
+
+//Set on a frame that was freed while pinned; it is released on its last unpin
+#define FRAME_FREE_DEFERRED 0x1
+
+//Structure to represent the bookkeeping kept for each physical frame. pte
+//points back at the live page table entry mapping the frame, if any. shares
+//counts the entries mapping it beyond the first mapping, so private frames
+//need no reference counting; it changes atomically since the sharers can be
+//in different contexts. A frame holding a page table records the context
+//that owns the table in owner.
+typedef struct frame_info {
+    pte_t *pte;
+    unsigned int pin_count;
+    unsigned int flags;
+    unsigned int shares;
+    struct vm_context *owner;
+}frame_info;
+
+//Structure to represent a pinned view of a virtual range: direct host
+//pointers to its frames, one iovec per physically contiguous run
+typedef struct t_view {
+    struct iovec *iov;
+    int iov_count;
+    void *va;
+    unsigned long size;
+    struct vm_context *context;
+}t_view;
 
 //Structure to represents TLB
 typedef struct tlb {
-    /*Assume your TLB is a direct mapped TLB with number of entries as TLB_ENTRIES
-    * Think about the size of each TLB entry that performs virtual to physical
-    * address translation.
+    /*The TLB has TLB_ENTRIES entries grouped into sets of TLB_WAYS ways.
+    * Each entry caches one virtual page to page table entry translation of
+    * the context with the entry's asid, and is only valid while the
+    * context's shootdown generation is the one it was filled in.
     */
    void *va;
    void *pa;
+   unsigned long asid;
+   unsigned long generation;
+   unsigned long last_used;
+   unsigned char valid;
+   unsigned char referenced;
+   unsigned char prefetched;
 
 }tlb;
-struct tlb tlb_store;
 
+//Number of superpage translations each thread caches, direct mapped
+#define SUPER_TLB_ENTRIES 16
+
+//Structure to report where a TLB lookup hit or a TLB fill landed, and
+//whether the hit was the first use of a prefetched entry
+typedef struct tlb_info {
+    int policy;
+    unsigned long set;
+    unsigned int way;
+    bool evicted;
+    bool prefetched;
+}tlb_info;
+extern struct tlb tlb_store;
+
+//Structure to describe one buffer of a vectored get_values/put_values call
+typedef struct t_iovec {
+    void *va;
+    void *buf;
+    int size;
+}t_iovec;
+
+//Structure to describe count elements of elem_size bytes, stride bytes apart
+//starting at va, that are copied to or from back to back slots in buf
+typedef struct t_strided {
+    void *va;
+    long stride;
+    unsigned int count;
+    unsigned int elem_size;
+    void *buf;
+}t_strided;
+
+//Structure to remember the last page translated during a batch of copies.
+//A write that stops at a shared page leaves the rest of its range in cow_va
+//and cow_size, so every shared page of it is copied at once. A lookup that
+//fails on a fault leaves why in error.
+typedef struct page_cache {
+    unsigned long vpn;
+    void *page;
+    void *cow_va;
+    unsigned long cow_size;
+    int error;
+}page_cache;
+
+//Structure to represent a copy on write snapshot of the address space: its
+//own page tables, sharing every frame with the live address space
+typedef struct vm_snapshot {
+    pde_t *page_directory;
+    unsigned long num_pages;
+}vm_snapshot;
+
+//Structure to represent a page looked at by a merge pass: the hash of its
+//contents, its page and its page table entry as the pass last saw it
+typedef struct merge_candidate {
+    uint64_t hash;
+    unsigned long vpn;
+    pte_t *pte;
+    pte_t entry;
+}merge_candidate;
+
+//Element types for mat_mult_ex, both MAT_ELEM_SIZE bytes wide
+#define MAT_INT 0
+#define MAT_FLOAT 1
+#define MAT_ELEM_SIZE 4
 
-void set_physical_mem();
-pte_t* translate(pde_t *pgdir, void *va);
-int page_map(pde_t *pgdir, void *va, void* pa);
+//mat_mult_ex works on MAT_TILE x MAT_TILE tiles and updates them
+//MAT_VECTOR_BYTES at a time
+#define MAT_TILE 64
+#define MAT_VECTOR_BYTES 32
+#define MAT_VECTOR_LANES (MAT_VECTOR_BYTES / MAT_ELEM_SIZE)
+typedef int mat_vec_int __attribute__((vector_size(MAT_VECTOR_BYTES)));
+typedef float mat_vec_float __attribute__((vector_size(MAT_VECTOR_BYTES)));
+
+//Allocations of up to SLAB_MAX_SIZE bytes are carved out of shared slab pages
+//in power of two size classes starting at SLAB_MIN_SIZE
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE (PGSIZE / 2)
+#define NUM_SLAB_CLASSES 8
+#define SLAB_HASH_SIZE 1024
+
+//Operations that t_vm_stats keeps latency histograms for
+#define VM_OP_MALLOC 0
+#define VM_OP_FREE 1
+#define VM_OP_GET 2
+#define VM_OP_PUT 3
+#define VM_OP_COPY 4
+#define VM_OP_SET 5
+#define VM_OP_DECOMPRESS 6
+#define VM_OP_REALLOC 7
+#define VM_NUM_OPS 8
+
+//Latency bucket i counts calls that took [2^(i-1), 2^i) nanoseconds, the
+//last bucket also counts everything slower
+#define VM_LATENCY_BUCKETS 32
+
+//Structure to represent the counters each thread keeps for itself, so
+//counting needs no atomics and no writes to shared memory
+typedef struct vm_counters {
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long bytes_allocated;
+    unsigned long bytes_freed;
+    unsigned long page_walks;
+    unsigned long page_faults;
+    unsigned long swap_ins;
+    unsigned long zpool_loads;
+    unsigned long cow_faults;
+    unsigned long reallocs;
+    unsigned long pages_remapped;
+    unsigned long lock_acquires;
+    unsigned long lock_contended;
+    unsigned long lock_wait_ns;
+    unsigned long latency[VM_NUM_OPS][VM_LATENCY_BUCKETS];
+}vm_counters;
+
+//Structure to represent a snapshot of the counters of one thread
+typedef struct vm_thread_stats {
+    unsigned long tlb_lookups;
+    unsigned long tlb_hits;
+    unsigned long tlb_misses;
+    unsigned long tlb_evictions;
+    unsigned long tlb_prefetches;
+    unsigned long tlb_prefetch_hits;
+    struct vm_counters counters;
+}vm_thread_stats;
+
+//Structure to represent a snapshot of the whole VM. Counters are summed over
+//live and exited threads and virtual pages over every context. Fragmentation
+//is the share of free frames in blocks smaller than the largest the buddy
+//allocator can hand out. Prefetch accuracy is the share of prefetched
+//translations that were used, coverage the share of would-be misses that a
+//prefetch turned into hits. The compressed pool holds zpool_pages pages in
+//zpool_bytes bytes, and zpool_ratio is how many times smaller they got.
+//Merging counts the frames freed by mapping a page to an identical one or to
+//the zero page.
+typedef struct vm_stats {
+    struct vm_thread_stats totals;
+    unsigned long num_threads;
+    unsigned long swap_outs;
+    unsigned long zpool_stores;
+    unsigned long zpool_rejects;
+    unsigned long zpool_pages;
+    unsigned long zpool_bytes;
+    unsigned long zpool_capacity;
+    double zpool_ratio;
+    unsigned long pages_merged;
+    unsigned long zero_pages_merged;
+    unsigned long physical_pages;
+    unsigned long physical_free;
+    double physical_utilization;
+    unsigned long num_contexts;
+    unsigned long virtual_pages;
+    unsigned long virtual_used;
+    double virtual_utilization;
+    unsigned long bytes_mapped;
+    unsigned long largest_free_block;
+    double fragmentation;
+    double prefetch_accuracy;
+    double prefetch_coverage;
+}vm_stats;
+
+//Structure to represent the state private to each thread using the VM: its
+//own TLB and superpage TLB, the shootdown generation that TLB is valid for, its counters,
+//the last page and stride of the stream the prefetcher follows, and
+//its read section counter (odd while it is inside get_value or put_value)
+typedef struct vm_thread {
+    tlb *tlb_arr;
+    tlb super_tlb[SUPER_TLB_ENTRIES];
+    unsigned int *tlb_clock_hands;
+    unsigned int tlb_num_entries;
+    unsigned int tlb_num_ways;
+    unsigned int tlb_num_sets;
+    int tlb_policy;
+    unsigned long tlb_generation;
+    unsigned long tlb_count;
+    unsigned long tlb_lookups;
+    unsigned long tlb_misses;
+    unsigned long tlb_evictions;
+    unsigned long tlb_prefetches;
+    unsigned long tlb_prefetch_hits;
+    unsigned long prefetch_asid;
+    unsigned long prefetch_vpn;
+    long prefetch_stride;
+    struct vm_counters stats;
+    unsigned long read_seq;
+    struct vm_thread *next;
+    struct vm_thread *prev;
+}vm_thread;
+
+//Structure to represent one slab page of a size class
+typedef struct slab {
+    void *va;
+    unsigned int slab_class;
+    unsigned int obj_size;
+    unsigned int num_objs;
+    unsigned int num_free;
+    unsigned char used[PGSIZE / SLAB_MIN_SIZE / 8];
+    struct slab *next;
+    struct slab *prev;
+    struct slab *hash_next;
+}slab;
+
+//Structure to represent one address space. Contexts share the physical frames,
+//the swap file and each thread's TLB, whose entries are tagged with the asid so
+//switching contexts flushes nothing; everything else, including the lock, is
+//per context. The tlb_generation is bumped by every shootdown of the context.
+typedef struct vm_context {
+    pde_t *page_directory;
+    struct bitmap virtual_bitmap;
+    struct slab *slab_partial[NUM_SLAB_CLASSES];
+    struct slab *slab_hash[SLAB_HASH_SIZE];
+    pthread_mutex_t lock;
+    unsigned long asid;
+    unsigned long tlb_generation;
+    unsigned long clock_hand;
+    struct vm_context *next;
+    struct vm_context *prev;
+}vm_context;
+
+
+int set_physical_mem();
+int set_physical_mem_size(unsigned long size, bool hugepages);
+pte_t* translate(struct vm_context *ctx, void *va);
+pte_t *walk_page_tables(pde_t *pgdir, void *va, bool alloc, pde_t **pde);
+void *alloc_page_table(struct vm_context *ctx);
+int page_map(struct vm_context *ctx, void *va, void* pa);
+int map_superpage(struct vm_context *ctx, void *va, void *pa);
+void demote_superpage(struct vm_context *ctx, void *va);
+void add_super_TLB(struct vm_context *ctx, void *va, pte_t *page_table, unsigned long generation);
 bool check_in_tlb(void *va);
 void put_in_tlb(void *va, void *pa);
 void *t_malloc(unsigned int num_bytes);
 void t_free(void *va, int size);
+void *t_realloc(void *va, unsigned int old_size, unsigned int new_size);
 int put_value(void *va, void *val, int size);
 void get_value(void *va, void *val, int size);
+int put_values(struct t_iovec *iov, int count);
+int get_values(struct t_iovec *iov, int count);
+int put_strided(struct t_strided *desc);
+int get_strided(struct t_strided *desc);
+int t_memcpy(void *dst, void *src, unsigned long n);
+int t_memmove(void *dst, void *src, unsigned long n);
+int t_memset(void *va, int value, unsigned long n);
+int t_pin(void *va, unsigned long size, struct t_view *view);
+void t_unpin(struct t_view *view);
+struct vm_snapshot *t_snapshot();
+int t_snapshot_get(struct vm_snapshot *snapshot, void *va, void *val, int size);
+void t_snapshot_free(struct vm_snapshot *snapshot);
+int t_merge_pages();
+struct vm_context *t_vm_create();
+void t_vm_destroy(struct vm_context *ctx);
+struct vm_context *t_vm_fork(struct vm_context *ctx);
+struct vm_snapshot *t_vm_snapshot(struct vm_context *ctx);
+void *t_vm_malloc(struct vm_context *ctx, unsigned int num_bytes);
+void t_vm_free(struct vm_context *ctx, void *va, int size);
+void *t_vm_realloc(struct vm_context *ctx, void *va, unsigned int old_size, unsigned int new_size);
+int t_vm_put_value(struct vm_context *ctx, void *va, void *val, int size);
+int t_vm_get_value(struct vm_context *ctx, void *va, void *val, int size);
+int t_vm_put_values(struct vm_context *ctx, struct t_iovec *iov, int count);
+int t_vm_get_values(struct vm_context *ctx, struct t_iovec *iov, int count);
+int t_vm_put_strided(struct vm_context *ctx, struct t_strided *desc);
+int t_vm_get_strided(struct vm_context *ctx, struct t_strided *desc);
+int t_vm_pin(struct vm_context *ctx, void *va, unsigned long size, struct t_view *view);
+int t_vm_memcpy(struct vm_context *ctx, void *dst, void *src, unsigned long n);
+int t_vm_memmove(struct vm_context *ctx, void *dst, void *src, unsigned long n);
+int t_vm_memset(struct vm_context *ctx, void *va, int value, unsigned long n);
+int t_vm_merge_pages(struct vm_context *ctx);
+int t_vm_mat_mult_ex(struct vm_context *ctx, void *mat1, void *mat2, void *answer, int m, int k, int n, int type);
 void mat_mult(void *mat1, void *mat2, int size, void *answer);
+int mat_mult_ex(void *mat1, void *mat2, void *answer, int m, int k, int n, int type);
 void print_TLB_missrate();
+void t_vm_stats(struct vm_stats *stats);
+int t_vm_thread_stats(struct vm_thread_stats *stats, int max_threads);
+void set_latency_stats(bool enabled);
+void add_counters(struct vm_counters *total, struct vm_counters *counters);
+void lock_vm(struct vm_context *ctx);
+unsigned long latency_start();
+void record_latency(struct vm_thread *thread, int op, unsigned long start);
 
 void set_bit(unsigned char* bitmap, unsigned long index, unsigned int value);
 int get_bit(unsigned char* bitmap, unsigned long index);
 void init_bit_values();
 void print_bit_values();
-unsigned int num_bits_in_value(unsigned int value);
-void init_page_tables();
-unsigned long next_free_page(unsigned char* bitmap);
+unsigned int num_bits_in_value(unsigned long value);
+int init_context(struct vm_context *ctx);
+void bitmap_destroy(struct bitmap* bitmap);
+int bitmap_init(struct bitmap* bitmap, unsigned long num_bits);
+void bitmap_set(struct bitmap* bitmap, unsigned long index, unsigned int value);
+int bitmap_get(struct bitmap* bitmap, unsigned long index);
+unsigned long bitmap_find_free_run(struct bitmap* bitmap, unsigned long num_bits);
+bool bitmap_range_clear(struct bitmap* bitmap, unsigned long index, unsigned long num_bits);
+unsigned long bitmap_find_aligned_run(struct bitmap* bitmap, unsigned long num_bits, unsigned long align);
 void* get_physical_addr_from_bit(unsigned long pageNumInBitmap);
 unsigned long get_bit_position_from_pointer(void* pa);
-void *get_next_avail_physical(int num_pages);
+struct frame_info *get_frame_info(void* pa);
+int buddy_init(struct buddy* buddy, unsigned long num_frames);
+void buddy_destroy(struct buddy* buddy);
+void buddy_free_range(struct buddy* buddy, unsigned long frame, unsigned long num_frames);
+unsigned long buddy_alloc(struct buddy* buddy, unsigned long num_frames);
+void *alloc_frames(unsigned int num_pages);
+void free_frames(void *pa, unsigned int num_pages);
+void release_free_blocks(unsigned long frame, unsigned long num_frames);
 unsigned long get_tlb_index(void *va);
+int set_tlb_config(unsigned int entries, unsigned int ways, int policy);
+int set_tlb_prefetch(unsigned int depth);
+void prefetch_TLB(struct vm_context *ctx, void *va, bool hit);
+struct vm_thread *get_vm_thread();
+void init_TLB(struct vm_thread *thread);
+void tlb_shootdown(struct vm_context *ctx);
+void enter_read_section(struct vm_thread *thread);
+void exit_read_section(struct vm_thread *thread);
+void synchronize_readers();
+int copy_value(struct vm_context *ctx, void *va, void *val, unsigned long size, bool write);
+void *get_cached_page(struct vm_context *ctx, struct page_cache *cache, void *va, bool write);
+void *handle_page_fault(pte_t *pte, int *error);
+void *pte_frame(pte_t entry);
+void set_demand_paging(bool enabled);
+void release_entry(pte_t entry);
+int unlink_empty_tables(struct vm_context *ctx, void *va, void **tables, int num_tables);
+void free_context_tables(pde_t *table, int level);
+void free_slabs(struct vm_context *ctx);
+bool resolve_in_read_section(struct vm_context *ctx, struct vm_thread *thread, struct page_cache *cache, int error);
+int break_cow(struct vm_context *ctx, pte_t *pte, void *va);
+int copy_on_write(struct vm_context *ctx, void *va, unsigned long size);
+void *copy_frame(struct vm_context *ctx, void *pa);
+void add_share(struct frame_info *frame);
+bool drop_share(struct frame_info *frame);
+struct vm_snapshot *snapshot_context(struct vm_context *ctx);
+int clone_table(struct vm_context *ctx, pde_t *table, pde_t *copy, int level, unsigned long first_vpn, struct vm_snapshot *snapshot);
+void adopt_table(struct vm_context *ctx, pde_t *table, int level, unsigned long first_vpn);
+void free_snapshot_table(pde_t *table, int level);
+bool spill_snapshot_table(pde_t *table, int level);
+int merge_frames(struct vm_context *ctx);
+void find_merge_candidates(struct vm_context *ctx, pde_t *table, int level, unsigned long first_vpn, struct merge_candidate *candidates, unsigned long *num_candidates);
+uint64_t hash_page(const void *page);
+int set_swap_file(const char *path, unsigned long size);
+int set_compressed_tier(unsigned long size);
+void start_swap_daemon();
+pte_t store_page(void *frame);
+int load_page(pte_t entry, void *frame);
+void free_stored_page(pte_t entry);
+bool share_stored_page(pte_t *pte, pte_t entry);
+unsigned int lz_compress(const unsigned char *in, unsigned int in_len, unsigned char *out, unsigned int out_max);
+int lz_decompress(const unsigned char *in, unsigned int in_len, unsigned char *out, unsigned int out_len);
+void set_swap_watermarks();
+int read_swap_slot(unsigned long slot, void *frame);
+int write_swap_slot(unsigned long slot, void *frame);
+unsigned long alloc_swap_slot();
+void free_swap_slot(unsigned long slot);
+void wake_swap_daemon();
+void *swap_daemon(void *arg);
+unsigned int reclaim_frames(unsigned int num_frames);
+int evict_frames(struct vm_context *ctx, unsigned int num_frames);
+int copy_range(struct vm_context *ctx, struct page_cache *cache, void *va, void *val, unsigned long size, bool write);
+int move_memory(struct vm_context *ctx, void *dst, void *src, int value, unsigned long n, bool backward);
+int move_range(struct vm_context *ctx, struct page_cache *dst_cache, struct page_cache *src_cache, void **dst, void **src, int value, unsigned long *n, bool backward);
+void *get_cached_run(struct vm_context *ctx, struct page_cache *cache, void *va, unsigned long n, bool write, unsigned long *run);
+unsigned int get_tlb_victim(struct vm_thread *thread, unsigned long set);
+int add_TLB(struct vm_context *ctx, void *va, void *pa, unsigned long generation, struct tlb_info *info);
+pte_t *check_TLB(struct vm_context *ctx, void *va, struct tlb_info *info);
+tlb *find_TLB_entry(struct vm_thread *thread, struct vm_context *ctx, unsigned long vpn, unsigned long generation);
+
+void *alloc_pages(struct vm_context *ctx, unsigned int num_pages);
+void *find_free_pages(struct vm_context *ctx, unsigned int num_pages);
+int map_pages(struct vm_context *ctx, void *va, unsigned int num_pages, bool reserve_only);
+void remap_pages(struct vm_context *ctx, void *old_va, void *new_va, unsigned int num_pages);
+void free_pages(struct vm_context *ctx, void *va, unsigned int num_pages);
+void unmap_pages(struct vm_context *ctx, unsigned long first_vpn, unsigned int num_pages, pte_t *entries, pte_t **ptes,
+                 void **tables);
+bool range_is_mapped(struct vm_context *ctx, void *va, unsigned long size);
+struct slab *find_slab(struct vm_context *ctx, void *va);
+int get_slab_class(unsigned int num_bytes);
+void slab_list_remove(struct vm_context *ctx, struct slab *slab);
+void slab_list_push(struct vm_context *ctx, struct slab *slab);
+void *slab_alloc(struct vm_context *ctx, unsigned int num_bytes);
+void slab_free(struct vm_context *ctx, struct slab *slab, void *va);
 
 #endif